@@ -0,0 +1,452 @@
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <iomanip>
+#include <random>
+#include <string>
+#include <thread>
+
+#include "argh.h"
+#include "lib_od.h"
+#include "lib_oc.h"
+#include "lib_nn.h"
+#include "lib_fs.h"
+#include "lib_mr.h"
+
+void print_help() {
+  std::cout<<"Benchmark of the detection and classification pipeline."<<std::endl
+    <<"usage: bench [-r] [-k] [-t] [-i] [-n] [-h]"<<std::endl<<std::endl
+    <<"Parameters:"<<std::endl
+    <<"  -r, number of repetitions of each benchmark [default = 5]"<<std::endl
+    <<"  -k, the number of nearest neighbors         [default = 1]"<<std::endl
+    <<"  -t, the folder with the test images         [default = './resources/test/']"<<std::endl
+    <<"  -i, the folder with the training images     [default = './resources/train/']"<<std::endl
+    <<"  -n, number of synthetic instances (jittered training instances) searched by the HNSW benchmark [default = 20000]"<<std::endl
+    <<"  -h, this help message"<<std::endl;
+}
+
+/**
+ * Runs f (which processes the given number of items) the given number of times,
+ * and prints the latency per item and the throughput.
+ */
+template<class F>
+void bench(const std::string& name, const size_t items, const unsigned int repetitions, F&& f) {
+  // warm up (caches, lazy allocations)
+  f();
+  auto start = std::chrono::steady_clock::now();
+  for(unsigned int r = 0; r < repetitions; r++) {
+    f();
+  }
+  const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  const double calls = static_cast<double>(items) * repetitions;
+  std::cout<<std::left<<std::setw(40)<<name<<std::right
+    <<std::setw(10)<<items
+    <<std::setw(16)<<std::fixed<<std::setprecision(3)<<(calls > 0 ? elapsed / calls * 1e6 : 0.0)
+    <<std::setw(16)<<std::setprecision(1)<<(elapsed > 0 ? calls / elapsed : 0.0)<<std::endl;
+}
+
+// prevents the compiler from discarding the benchmarked computations
+volatile double sink = 0;
+
+// the approximate searches fail the benchmark below this recall, with the graph beam and the re-ranking checked
+const double min_recall = 0.95;
+const size_t checked_ef = 50;
+const unsigned int checked_rerank = 4;
+
+int main(const int argc, const char** argv) {
+  argh::parser cmdl;
+  cmdl.add_params({"-r", "-k", "-t", "-i", "-n"}); // batch pre-register multiple params: name + value
+  cmdl.parse(argc, argv);
+
+  if (cmdl["-h"]) {
+    print_help();
+    return EXIT_SUCCESS;
+  }
+
+  unsigned int repetitions = 5;
+  if (cmdl("-r")) {
+    std::string value;
+    cmdl("-r") >> value;
+    repetitions = std::atoi(value.c_str());
+  }
+
+  unsigned int k = 1;
+  if (cmdl("-k")) {
+    std::string value;
+    cmdl("-k") >> value;
+    k = std::atoi(value.c_str());
+  }
+
+  std::string test = "./resources/test/";
+  if (cmdl("-t")) {
+    cmdl("-t") >> test;
+  }
+
+  unsigned int synthetic = 20000;
+  if (cmdl("-n")) {
+    std::string value;
+    cmdl("-n") >> value;
+    synthetic = std::atoi(value.c_str());
+  }
+
+  std::string train = "./resources/train/";
+  if (cmdl("-i")) {
+    cmdl("-i") >> train;
+  }
+
+  auto test_files = get_files(test);
+  std::vector<std::pair<std::string, fs::path>> train_files;
+  for (auto c: get_directories(train)) {
+    for (auto f: get_files(c)) {
+      train_files.push_back(std::make_pair(c.filename().u8string(), f));
+    }
+  }
+
+  std::cout<<"Repetitions = "<<repetitions<<std::endl
+    <<"Test images = "<<test_files.size()<<std::endl
+    <<"Train images = "<<train_files.size()<<std::endl
+    <<"Distance kernel = "<<simd_kernel()<<std::endl<<std::endl;
+
+  PipelineWorkspace ws;
+
+  // the morphological reconstruction must match the iterative reference, pixel by pixel
+  size_t mismatches = 0;
+  std::vector<std::pair<cv::Mat, cv::Mat>> reconstructions;
+  for (auto f: test_files) {
+    cv::Mat bw = cv::imread(f, cv::IMREAD_GRAYSCALE), smooth, binary, marker, fast, reference;
+    cv::medianBlur(bw, smooth, ws.median_size);
+    cv::threshold(smooth, binary, 0, 255, cv::THRESH_BINARY_INV | cv::THRESH_OTSU);
+    imfill(binary);
+    cv::morphologyEx(binary, marker, cv::MORPH_ERODE, ws.kernel_erode);
+    morphological_reconstruction(binary, marker, ws.kernel_rec, fast);
+    morphological_reconstruction_iterative(binary, marker, ws.kernel_rec, reference);
+    mismatches += cv::countNonZero(fast != reference);
+    // markers above the mask, in gray levels: the smoothed image under the binary mask and the other way around
+    morphological_reconstruction(binary, smooth, ws.kernel_rec, fast);
+    morphological_reconstruction_iterative(binary, smooth, ws.kernel_rec, reference);
+    mismatches += cv::countNonZero(fast != reference);
+    morphological_reconstruction(smooth, marker, ws.kernel_rec, fast);
+    morphological_reconstruction_iterative(smooth, marker, ws.kernel_rec, reference);
+    mismatches += cv::countNonZero(fast != reference);
+    reconstructions.push_back(std::make_pair(binary, marker));
+  }
+  std::cout<<"Reconstruction mismatches = "<<mismatches<<std::endl;
+
+  // a workspace reused after a larger image (with content past the borders of the next one)
+  // must find the objects of a fresh workspace
+  size_t reuse_mismatches = 0;
+  for (unsigned int pre = 0; pre < 2; pre++) {
+    for (auto f: test_files) {
+      const cv::Mat image = cv::imread(f, cv::IMREAD_UNCHANGED);
+      cv::Mat larger;
+      cv::copyMakeBorder(image, larger, 0, 64, 0, 64, cv::BORDER_REFLECT);
+      PipelineWorkspace reused, fresh;
+      get_objects(pre, larger, reused);
+      reuse_mismatches += get_objects(pre, image, reused).contours != get_objects(pre, image, fresh).contours;
+    }
+  }
+  std::cout<<"Workspace reuse mismatches = "<<reuse_mismatches<<std::endl<<std::endl;
+  mismatches += reuse_mismatches;
+
+  std::cout<<std::left<<std::setw(40)<<"benchmark"<<std::right<<std::setw(10)<<"items"
+    <<std::setw(16)<<"us/item"<<std::setw(16)<<"items/s"<<std::endl;
+
+  bench("morphological_reconstruction", reconstructions.size(), repetitions, [&]() {
+    for (auto& r: reconstructions) {
+      cv::Mat out;
+      morphological_reconstruction(r.first, r.second, ws.kernel_rec, out, ws.queue);
+    }
+  });
+
+  bench("morphological_reconstruction_iterative", reconstructions.size(), repetitions, [&]() {
+    for (auto& r: reconstructions) {
+      cv::Mat out;
+      morphological_reconstruction_iterative(r.first, r.second, ws.kernel_rec, out);
+    }
+  });
+
+  // the watershed preprocessing (2) opens windows, so it is not benchmarked
+  for (unsigned int pre = 0; pre < 2; pre++) {
+    bench("get_objects (p = " + std::to_string(pre) + ")", test_files.size(), repetitions, [&]() {
+      for (auto f: test_files) {
+        sink = sink + get_objects(pre, f, ws).objects.size();
+      }
+    });
+  }
+
+  // the objects of the test images are the queries of the classifiers
+  std::vector<Detection> detections;
+  std::vector<Object> objects;
+  std::vector<ContourView> contours;
+  for (auto f: test_files) {
+    detections.push_back(get_objects(0, f, ws));
+    for (auto o: detections.back().objects) {
+      objects.push_back(o);
+      contours.push_back(o.get_contour());
+    }
+  }
+
+  bench("chain", contours.size(), repetitions, [&]() {
+    for (auto& c: contours) {
+      sink = sink + chain(c).size();
+    }
+  });
+
+  bench("chain_code", contours.size(), repetitions, [&]() {
+    for (auto& c: contours) {
+      sink = sink + chain_code(c).perimeter();
+    }
+  });
+
+  bench("contour_shape", contours.size(), repetitions, [&]() {
+    for (auto& c: contours) {
+      sink = sink + contour_shape(c).major_axis;
+    }
+  });
+
+  bench("convex_hull", contours.size(), repetitions, [&]() {
+    for (auto& c: contours) {
+      sink = sink + convex_hull(c).size();
+    }
+  });
+
+  bench("Features::Features", contours.size(), repetitions, [&]() {
+    for (auto& c: contours) {
+      sink = sink + Features(c).get_solidity();
+    }
+  });
+
+  std::vector<Features> features;
+  for (auto& c: contours) {
+    features.push_back(Features(c));
+  }
+
+  for (unsigned int d = 0; d < 4; d++) {
+    bench("Features::distance (d = " + std::to_string(d) + ")", features.size() * features.size(), repetitions, [&]() {
+      for (auto& a: features) {
+        for (auto& b: features) {
+          sink = sink + a.distance(b, d);
+        }
+      }
+    });
+  }
+
+  // training instances, extracted as train does
+  std::vector<std::pair<std::string, Features>> instances;
+  for (auto& t: train_files) {
+    auto detection = get_objects(0, t.second, ws);
+    const auto& objs = detection.objects;
+    if (objs.size() > 0) {
+      auto object = *std::max_element(std::begin(objs), std::end(objs));
+      instances.push_back(std::make_pair(t.first, Features(object.get_contour())));
+    }
+  }
+
+  for (unsigned int d = 0; d < 4; d++) {
+    KNN knn(k, d);
+    knn.learn(instances);
+    bench("KNN::predict (d = " + std::to_string(d) + ")", objects.size(), repetitions, [&]() {
+      for (auto& f: features) {
+        sink = sink + knn.predict(f);
+      }
+    });
+    bench("KNN::predict_batch (d = " + std::to_string(d) + ")", objects.size(), repetitions, [&]() {
+      sink = sink + knn.predict_batch(features).size();
+    });
+    knn.quantize();
+    bench("KNN::predict quantized (d = " + std::to_string(d) + ")", objects.size(), repetitions, [&]() {
+      for (auto& f: features) {
+        sink = sink + knn.predict(f);
+      }
+    });
+  }
+
+  // the tree against an exhaustive scan of the same columns (a single leaf)
+  std::vector<FeatureVector> points;
+  for (auto& i: instances) {
+    points.push_back(i.second.get_features());
+  }
+  for (unsigned int d = 0; d < 4; d++) {
+    KDTree tree(points, d), flat(points, d, std::max<size_t>(points.size(), 1));
+    bench("KDTree::search (d = " + std::to_string(d) + ")", features.size(), repetitions, [&]() {
+      for (auto& f: features) {
+        sink = sink + tree.search(f.get_features(), k).size();
+      }
+    });
+    bench("KDTree::search exhaustive (d = " + std::to_string(d) + ")", features.size(), repetitions, [&]() {
+      for (auto& f: features) {
+        sink = sink + flat.search(f.get_features(), k).size();
+      }
+    });
+  }
+
+  // the graph and the codes pay off on larger sets than the training images, so they are searched over jittered
+  // copies of them; their recall is the fraction of the exact k nearest neighbours (from the tree) that they find
+  std::vector<FeatureVector> large;
+  std::mt19937 rng(42);
+  std::normal_distribution<double> jitter(0.0, 0.01);
+  for (size_t i = 0; i < synthetic && !points.empty(); i++) {
+    FeatureVector p = points[i % points.size()];
+    for (size_t j = 1; j < FeatureVector::length; j++) {
+      p[j] += jitter(rng);
+    }
+    large.push_back(p);
+  }
+  std::cout<<std::endl<<"Synthetic instances = "<<large.size()<<std::endl;
+  std::vector<FeatureVector> queries;
+  for (auto& f: features) {
+    queries.push_back(f.get_features());
+  }
+  for (unsigned int d = 1; d < 3 && !large.empty(); d++) {
+    const auto tree = std::make_shared<const KDTree>(large, d);
+    std::vector<std::vector<Neighbour>> exact;
+    for (auto& f: features) {
+      exact.push_back(tree->search(f.get_features(), k));
+    }
+    bench("KDTree::search (n, d = " + std::to_string(d) + ")", features.size(), repetitions, [&]() {
+      for (auto& f: features) {
+        sink = sink + tree->search(f.get_features(), k).size();
+      }
+    });
+    bench("KDTree::search_batch (n, d = " + std::to_string(d) + ")", features.size(), repetitions, [&]() {
+      sink = sink + tree->search_batch(queries, k).size();
+    });
+
+    std::unique_ptr<HNSW> graph;
+    bench("HNSW::HNSW (n, d = " + std::to_string(d) + ")", large.size(), 1, [&]() {
+      graph = std::make_unique<HNSW>(tree, d);
+    });
+    for (size_t ef: {size_t(10), checked_ef, size_t(200)}) {
+      size_t found = 0, total = 0;
+      for (size_t i = 0; i < features.size(); i++) {
+        const auto approximate = graph->search(features[i].get_features(), k, ef);
+        for (auto& e: exact[i]) {
+          total++;
+          found += std::any_of(approximate.begin(), approximate.end(), [&](const Neighbour& a) {
+            return a.index == e.index;
+          });
+        }
+      }
+      const double recall = total > 0 ? static_cast<double>(found) / total : 1.0;
+      std::cout<<"HNSW recall@"<<k<<" (d = "<<d<<", ef = "<<ef<<") = "<<std::setprecision(4)<<recall<<std::endl;
+      if (ef == checked_ef && recall < min_recall) {
+        std::cout<<"HNSW recall below "<<min_recall<<std::endl;
+        mismatches++;
+      }
+      bench("HNSW::search (n, d = " + std::to_string(d) + ", ef = " + std::to_string(ef) + ")", features.size(),
+        repetitions, [&]() {
+        for (auto& f: features) {
+          sink = sink + graph->search(f.get_features(), k, ef).size();
+        }
+      });
+    }
+
+    // the codes alone, and the best 4k candidates of the codes ranked again on the features
+    const QuantizedStore codes(large, d);
+    for (unsigned int rerank: {0u, checked_rerank}) {
+      auto search = [&](const FeatureVector& query) {
+        auto rv = codes.search(query, rerank > 0 ? rerank * k : k);
+        if (rerank > 0) {
+          metric::dispatch(d, [&](auto m) {
+            for (auto& n: rv) {
+              n.distance = metric::surrogate(m, query, large[n.index]);
+            }
+            return 0;
+          });
+          std::sort(rv.begin(), rv.end());
+          rv.resize(std::min<size_t>(rv.size(), k));
+        }
+        return rv;
+      };
+      size_t found = 0, total = 0;
+      for (size_t i = 0; i < features.size(); i++) {
+        const auto approximate = search(features[i].get_features());
+        for (auto& e: exact[i]) {
+          total++;
+          found += std::any_of(approximate.begin(), approximate.end(), [&](const Neighbour& a) {
+            return a.index == e.index;
+          });
+        }
+      }
+      const double recall = total > 0 ? static_cast<double>(found) / total : 1.0;
+      std::cout<<"QuantizedStore recall@"<<k<<" (d = "<<d<<", rerank = "<<rerank<<") = "
+        <<std::setprecision(4)<<recall<<std::endl;
+      if (rerank == checked_rerank && recall < min_recall) {
+        std::cout<<"QuantizedStore recall below "<<min_recall<<std::endl;
+        mismatches++;
+      }
+      bench("QuantizedStore::search (n, d = " + std::to_string(d) + ", rerank = " + std::to_string(rerank) + ")",
+        features.size(), repetitions, [&]() {
+        for (auto& f: features) {
+          sink = sink + search(f.get_features()).size();
+        }
+      });
+    }
+  }
+  std::cout<<std::endl;
+
+  // the synthetic instances as a model, loaded from each format and swapped while it classifies
+  std::vector<std::pair<std::string, Features>> labelled;
+  for (size_t i = 0; i < large.size(); i++) {
+    const FeatureVector& p = large[i];
+    std::array<double, 8> hist;
+    std::copy(p.begin() + 1, p.begin() + 9, hist.begin());
+    labelled.push_back(std::make_pair(instances[i % instances.size()].first,
+      Features(hist, p[9], p[10], p[11], p[12])));
+  }
+  if (!labelled.empty()) {
+    const fs::path json_path = fs::temp_directory_path() / "bench_model.json";
+    const fs::path binary_path = fs::temp_directory_path() / "bench_model.bin";
+    const KNN model(k, 2, labelled);
+    model.store(json_path.u8string());
+    model.store_binary(binary_path.u8string());
+
+    ModelRegistry registry;
+    bench("ModelRegistry::load json (n)", labelled.size(), 1, [&]() {
+      registry.load("json", json_path.u8string());
+    });
+    bench("ModelRegistry::load binary (n)", labelled.size(), repetitions, [&]() {
+      registry.load("binary", binary_path.u8string());
+    });
+    size_t disagreements = 0;
+    for (auto& f: features) {
+      disagreements += registry.get("json")->predict(f) != registry.get("binary")->predict(f);
+    }
+    std::cout<<"Binary vs json model mismatches = "<<disagreements<<std::endl;
+    mismatches += disagreements;
+
+    std::atomic<bool> done(false);
+    size_t swaps = 0;
+    std::thread swapper([&]() {
+      while (!done) {
+        registry.reload("binary");
+        swaps++;
+      }
+    });
+    bench("ModelRegistry::get + predict (swapping)", objects.size(), repetitions, [&]() {
+      for (auto& f: features) {
+        sink = sink + registry.get("binary")->predict(f);
+      }
+    });
+    done = true;
+    swapper.join();
+    std::cout<<"Swaps during the classifications = "<<swaps<<std::endl<<std::endl;
+    fs::remove(json_path);
+    fs::remove(binary_path);
+  }
+
+  LR lr;
+  bench("LR::learn", instances.size(), repetitions, [&]() {
+    lr = LR();
+    lr.learn(instances);
+  });
+
+  bench("LR::predict", objects.size(), repetitions, [&]() {
+    for (auto& f: features) {
+      sink = sink + lr.predict(f);
+    }
+  });
+
+  return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,60 @@
+#include <iostream>
+#include <string>
+
+#include "argh.h"
+#include "lib_mf.h"
+#include "lib_oc.h"
+
+void print_help() {
+  std::cout<<"Program used to convert a model between the json and the binary formats."<<std::endl
+    <<"usage: convert [-i] [-o] [-h]"<<std::endl<<std::endl
+    <<"Parameters:"<<std::endl
+    <<"  -i, the input model, json or binary (its checksum is checked) [default = './resources/model/model.json']"<<std::endl
+    <<"  -o, the output model, json if it ends with '.json' and binary otherwise [default = './resources/model/model.bin']"<<std::endl
+    <<"  -h, this help message"<<std::endl;
+}
+
+bool ends_with(const std::string &s, const std::string &suffix) {
+  return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+int main(const int argc, const char** argv) {
+  argh::parser cmdl;
+  cmdl.add_params({"-i", "-o"});
+  cmdl.parse(argc, argv);
+
+  if (cmdl["-h"]) {
+    print_help();
+    return EXIT_SUCCESS;
+  }
+
+  std::string input = "./resources/model/model.json";
+  if (cmdl("-i")) {
+    cmdl("-i") >> input;
+  }
+  std::cout<<"Input: "<<input<<std::endl;
+
+  std::string output = "./resources/model/model.bin";
+  if (cmdl("-o")) {
+    cmdl("-o") >> output;
+  }
+  std::cout<<"Output: "<<output<<std::endl;
+
+  try {
+    if (is_binary_model(input)) {
+      // the models are mapped without reading them whole, the checksum is only checked here
+      MappedFile(input).verify();
+    }
+    const auto model = ML::load(input);
+    if (ends_with(output, ".json")) {
+      model->store(output);
+    } else {
+      model->store_binary(output);
+    }
+  } catch (const std::exception &e) {
+    std::cerr<<e.what()<<std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,90 @@
+#include "lib_fc.h"
+
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+uint64_t hash_file(const fs::path &path) {
+  uint64_t hash = 14695981039346656037ULL;
+  std::ifstream i(path, std::ios::binary);
+  char buffer[1 << 16];
+  while(i) {
+    i.read(buffer, sizeof(buffer));
+    const std::streamsize n = i.gcount();
+    for(std::streamsize j = 0; j < n; j++) {
+      hash ^= static_cast<unsigned char>(buffer[j]);
+      hash *= 1099511628211ULL;
+    }
+  }
+  return hash;
+}
+
+FeatureCache::FeatureCache(const fs::path &_path, const unsigned int _pre) {
+  path = _path;
+  pre = _pre;
+
+  std::ifstream i(path);
+  if(!i) {
+    return;
+  }
+  json j;
+  i >> j;
+  if(j.value("version", 0u) != pipeline_version) {
+    return;
+  }
+  for(auto& r: j["records"].items()) {
+    if(r.value().is_null()) {
+      records[r.key()] = std::nullopt;
+    } else {
+      records[r.key()] = features_from_json(r.value());
+    }
+  }
+}
+
+std::string FeatureCache::key(const uint64_t hash) const {
+  std::ostringstream k;
+  k << pre << ":" << std::hex << std::setw(16) << std::setfill('0') << hash;
+  return k.str();
+}
+
+bool FeatureCache::find(const uint64_t hash, std::optional<Features> &features) const {
+  auto it = records.find(key(hash));
+  if(it == records.end()) {
+    return false;
+  }
+  features = it->second;
+  return true;
+}
+
+void FeatureCache::insert(const uint64_t hash, const std::optional<Features> &features) {
+  records.insert_or_assign(key(hash), features);
+}
+
+void FeatureCache::store() const {
+  json r = json::object();
+  for(auto& i: records) {
+    if(i.second) {
+      r[i.first] = *i.second;
+    } else {
+      r[i.first] = nullptr;
+    }
+  }
+  json j;
+  j["version"] = pipeline_version;
+  j["records"] = r;
+
+  if(path.has_parent_path()) {
+    fs::create_directories(path.parent_path());
+  }
+  fs::path tmp = path;
+  tmp += ".tmp";
+  {
+    std::ofstream o(tmp);
+    o << j << std::endl;
+  }
+  fs::rename(tmp, path);
+}
+
+size_t FeatureCache::size() const {
+  return records.size();
+}
@@ -0,0 +1,80 @@
+/**
+ * @file lib_fc.h
+ * @brief Feature Cache library
+ *
+ * Persistent cache of the features extracted from the training images.
+ * The records are keyed by the content of the image and the preprocessing method,
+ * so only new or changed images have to be segmented again.
+ *
+ * @author $Author: Catarina Silva $
+ * @version $Revision: 1.0 $
+ * @date $Date: 2020/10/14 $
+ */
+
+#ifndef FC_H
+#define FC_H
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+#include "lib_fs.h"
+#include "lib_oc.h"
+
+/**
+ * Hashes the content of a file (64 bit FNV-1a).
+ *
+ * @param path the file
+ * @return the hash of the bytes of the file
+ */
+uint64_t hash_file(const fs::path&);
+
+/**
+ * Features of the training images, stored as a json file.
+ * The lookups can run concurrently, as long as no record is inserted at the same time.
+ */
+class FeatureCache {
+  private:
+    fs::path path;
+    unsigned int pre;
+    // features by preprocessing method and image hash, an empty record means that no object was found
+    std::unordered_map<std::string, std::optional<Features>> records;
+    std::string key(const uint64_t) const;
+
+  public:
+    /**
+     * Loads the cache, the records of a different pipeline version are discarded.
+     * A missing file is an empty cache.
+     *
+     * @param path the cache file
+     * @param pre the preprocessing method of the records that are looked up and inserted
+     */
+    FeatureCache(const fs::path&, const unsigned int);
+
+    /**
+     * Looks up the features of an image.
+     *
+     * @param hash the hash of the image (see hash_file)
+     * @param features the cached features (empty if no object was found on the image)
+     * @return true if the image is cached
+     */
+    bool find(const uint64_t, std::optional<Features>&) const;
+
+    /**
+     * Adds (or replaces) the features of an image.
+     *
+     * @param hash the hash of the image (see hash_file)
+     * @param features the features of the image (empty if no object was found on the image)
+     */
+    void insert(const uint64_t, const std::optional<Features>&);
+
+    /**
+     * Writes the cache to disk, through a temporary file so an interrupted run never leaves a truncated cache.
+     */
+    void store() const;
+
+    size_t size() const;
+};
+
+#endif
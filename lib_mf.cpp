@@ -0,0 +1,120 @@
+#include "lib_mf.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// the values are written and mapped as they are in memory
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "the binary model format is little-endian");
+
+const char model_magic[8] = {'O', 'C', 'M', 'O', 'D', 'E', 'L', '\0'};
+
+bool is_binary_model(const std::string &path) {
+  std::ifstream i(path, std::ios::binary);
+  char magic[sizeof(model_magic)] = {0};
+  i.read(magic, sizeof(magic));
+  return i && std::equal(magic, magic + sizeof(magic), model_magic);
+}
+
+uint64_t checksum(const char *data, const size_t size) {
+  uint64_t hash = 14695981039346656037ULL;
+  for(size_t i = 0; i < size; i++) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+void write_model(const std::string &path, ModelHeader header, const std::string &payload) {
+  std::copy(model_magic, model_magic + sizeof(model_magic), header.magic);
+  header.version = model_version;
+  header.size = sizeof(ModelHeader) + payload.size();
+  header.checksum = checksum(payload.data(), payload.size());
+  std::fill(std::begin(header.reserved), std::end(header.reserved), 0);
+
+  // the previous file is replaced at once, the processes that mapped it keep reading its pages
+  const std::string temporary = path + ".tmp";
+  std::ofstream o(temporary, std::ios::binary);
+  put(o, header);
+  o.write(payload.data(), payload.size());
+  o.close();
+  if(!o || std::rename(temporary.c_str(), path.c_str()) != 0) {
+    std::remove(temporary.c_str());
+    throw std::runtime_error("cannot write the model file: " + path);
+  }
+}
+
+void pad(std::ostream &o, const size_t alignment) {
+  const size_t position = o.tellp();
+  for(size_t i = position % alignment; i > 0 && i < alignment; i++) {
+    o.put(0);
+  }
+}
+
+MappedFile::MappedFile(const std::string &_path) : path(_path) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if(fd < 0) {
+    throw std::runtime_error("cannot open the model file: " + path);
+  }
+  struct stat st;
+  if(fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(ModelHeader)) {
+    close(fd);
+    throw std::runtime_error("not a model file: " + path);
+  }
+  length = st.st_size;
+  void *address = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+  // the mapping keeps its own reference to the file
+  close(fd);
+  if(address == MAP_FAILED) {
+    throw std::runtime_error("cannot map the model file: " + path);
+  }
+  data = static_cast<const char*>(address);
+
+  const ModelHeader &h = header();
+  std::string error;
+  if(!std::equal(model_magic, model_magic + sizeof(model_magic), h.magic)) {
+    error = "not a model file: ";
+  } else if(h.version != model_version) {
+    error = "unsupported model version " + std::to_string(h.version) + ": ";
+  } else if(h.size != length) {
+    error = "truncated model file: ";
+  }
+  if(!error.empty()) {
+    munmap(const_cast<char*>(data), length);
+    throw std::runtime_error(error + path);
+  }
+}
+
+MappedFile::~MappedFile() {
+  munmap(const_cast<char*>(data), length);
+}
+
+void MappedFile::verify() const {
+  if(header().checksum != checksum(data + sizeof(ModelHeader), length - sizeof(ModelHeader))) {
+    throw std::runtime_error("corrupted model file: " + path);
+  }
+}
+
+const ModelHeader& MappedFile::header() const {
+  return *reinterpret_cast<const ModelHeader*>(data);
+}
+
+const char* MappedFile::begin() const {
+  return data;
+}
+
+size_t MappedFile::size() const {
+  return length;
+}
+
+ModelReader::ModelReader(const MappedFile &_file, const size_t _position) : file(_file), position(_position) {
+}
+
+void ModelReader::align(const size_t alignment) {
+  view<char>((alignment - position % alignment) % alignment);
+}
@@ -0,0 +1,185 @@
+/**
+ * @file lib_mf.h
+ * @brief Model File library
+ *
+ * Binary model files, mapped in memory and used in place.
+ * A file is a fixed header followed by the payload of the model; every value is little-endian,
+ * and the large arrays start on multiples of 64 bytes so they can be read directly from the mapping.
+ * The pages of a mapping are shared by every process that maps the same file.
+ *
+ * @author $Author: Catarina Silva $
+ * @version $Revision: 1.0 $
+ * @date $Date: 2020/10/14 $
+ */
+
+#ifndef MF_H
+#define MF_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+
+/**
+ * Version of the binary model format, files of other versions are rejected.
+ */
+const uint32_t model_version = 2;
+
+/**
+ * Models stored on the binary format (the same numbers as train -m).
+ */
+enum class ModelType : uint32_t {
+  knn = 1, lr = 2
+};
+
+/**
+ * Header of a binary model file.
+ */
+struct ModelHeader {
+  char magic[8];
+  uint32_t version;
+  ModelType model;
+  // parameters of the kNN models (0 on the others)
+  uint32_t k, d;
+  // number of labels, size (in bytes) of each feature and number of instances
+  uint32_t labels, feature_bytes;
+  uint64_t instances;
+  // size of the whole file and FNV-1a hash of everything after the header
+  uint64_t size, checksum;
+  // pipeline_version of the features the model was trained on
+  uint32_t pipeline;
+  char reserved[68];
+};
+static_assert(sizeof(ModelHeader) == 128, "the header keeps the payload aligned to 64 bytes");
+
+/**
+ * @param path a file
+ * @return true if the file starts as a binary model file
+ */
+bool is_binary_model(const std::string&);
+
+/**
+ * Hashes a range of bytes (64 bit FNV-1a).
+ *
+ * @param data the first byte
+ * @param size the number of bytes
+ * @return the hash
+ */
+uint64_t checksum(const char*, const size_t);
+
+/**
+ * Writes a binary model file: the header (with the size and checksum of the payload) and the payload.
+ * The file is written aside and renamed over the model, so a model that is mapped is never changed in place.
+ *
+ * @param path the model file
+ * @param header the header, its magic, version, size and checksum are filled in
+ * @param payload the bytes of the model
+ */
+void write_model(const std::string&, ModelHeader, const std::string&);
+
+/**
+ * Writes a value to a payload, as little-endian bytes.
+ *
+ * @param o the payload
+ * @param value the value
+ */
+template<class T>
+void put(std::ostream &o, const T &value) {
+  o.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+/**
+ * Pads a payload with zeros up to a multiple of the alignment.
+ *
+ * @param o the payload
+ * @param alignment the alignment in bytes
+ */
+void pad(std::ostream&, const size_t alignment=64);
+
+/**
+ * Read-only mapping of a binary model file.
+ * The header and the size are checked when the file is mapped; the checksum reads every page of the file,
+ * so it is only checked on demand (verify), and the pages of the models are read as they are searched.
+ */
+class MappedFile {
+  private:
+    std::string path;
+    const char *data;
+    size_t length;
+
+  public:
+    /**
+     * Maps a model file, throws std::runtime_error if it cannot be mapped or is not a valid model.
+     *
+     * @param path the model file
+     */
+    MappedFile(const std::string&);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    /**
+     * Checks the checksum of the payload, throws std::runtime_error if the file is corrupted.
+     */
+    void verify() const;
+
+    const ModelHeader& header() const;
+    const char* begin() const;
+    size_t size() const;
+};
+
+/**
+ * Sequential reader of the payload of a mapped model, every read is checked against the end of the file.
+ */
+class ModelReader {
+  private:
+    const MappedFile &file;
+    size_t position;
+
+  public:
+    /**
+     * @param file the mapped model
+     * @param position the first byte to read (the end of the header by default)
+     */
+    ModelReader(const MappedFile&, const size_t position=sizeof(ModelHeader));
+
+    /**
+     * @return the next value
+     */
+    template<class T>
+    T get() {
+      T rv;
+      std::memcpy(&rv, view<char>(sizeof(T)), sizeof(T));
+      return rv;
+    }
+
+    /**
+     * Points to the next values on the mapping, which must be aligned for their type.
+     *
+     * @param count the number of values
+     * @return the first value
+     */
+    template<class T>
+    const T* view(const size_t count) {
+      if(count > (file.size() - position) / sizeof(T)) {
+        throw std::runtime_error("truncated model file");
+      }
+      const T *rv = reinterpret_cast<const T*>(file.begin() + position);
+      if(reinterpret_cast<uintptr_t>(rv) % alignof(T) != 0) {
+        throw std::runtime_error("misaligned model file");
+      }
+      position += count * sizeof(T);
+      return rv;
+    }
+
+    /**
+     * Skips the padding up to a multiple of the alignment.
+     *
+     * @param alignment the alignment in bytes
+     */
+    void align(const size_t alignment=64);
+};
+
+#endif
@@ -0,0 +1,71 @@
+#include "lib_mr.h"
+
+#include <stdexcept>
+
+std::shared_ptr<const ML> ModelRegistry::load(const std::string &name, const std::string &path,
+const Prepare &prepare) {
+  // the slow part runs without the lock, the other models stay available meanwhile
+  std::shared_ptr<ML> model = ML::load(path);
+  if(prepare) {
+    prepare(*model);
+  }
+
+  replace(name, Entry{path, prepare, model});
+  return model;
+}
+
+std::shared_ptr<const ML> ModelRegistry::reload(const std::string &name) {
+  std::string path;
+  Prepare prepare;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = models.find(name);
+    if(it == models.end() || it->second.path.empty()) {
+      throw std::out_of_range("no model file for " + name);
+    }
+    path = it->second.path;
+    prepare = it->second.prepare;
+  }
+  return load(name, path, prepare);
+}
+
+void ModelRegistry::publish(const std::string &name, std::shared_ptr<const ML> model) {
+  replace(name, Entry{"", nullptr, std::move(model)});
+}
+
+void ModelRegistry::replace(const std::string &name, Entry entry) {
+  // the previous model is released after the lock, in case this was its last holder
+  std::shared_ptr<const ML> previous;
+  std::lock_guard<std::mutex> lock(mutex);
+  Entry &current = models[name];
+  previous = std::move(current.model);
+  current = std::move(entry);
+}
+
+std::shared_ptr<const ML> ModelRegistry::get(const std::string &name) const {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = models.find(name);
+  return it == models.end() ? nullptr : it->second.model;
+}
+
+bool ModelRegistry::remove(const std::string &name) {
+  // released after the lock, as on replace
+  std::shared_ptr<const ML> model;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = models.find(name);
+  if(it == models.end()) {
+    return false;
+  }
+  model = std::move(it->second.model);
+  models.erase(it);
+  return true;
+}
+
+std::vector<std::string> ModelRegistry::names() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::vector<std::string> rv;
+  for(auto& m: models) {
+    rv.push_back(m.first);
+  }
+  return rv;
+}
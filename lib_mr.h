@@ -0,0 +1,96 @@
+/**
+ * @file lib_mr.h
+ * @brief Model Registry library
+ *
+ * Several classification models loaded side by side by name (e.g. to compare two models on the same images),
+ * each of which can be replaced by a new version of its file while the classifications go on.
+ *
+ * @author $Author: Catarina Silva $
+ * @version $Revision: 1.0 $
+ * @date $Date: 2020/10/14 $
+ */
+
+#ifndef MR_H
+#define MR_H
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "lib_oc.h"
+
+/**
+ * Models by name, shared by every thread.
+ * A classification takes the current model of a name with get and keeps it until it ends,
+ * so replacing the model (load, reload or publish) never waits for it nor changes the model under it;
+ * the previous model is released with the last classification that holds it.
+ */
+class ModelRegistry {
+  public:
+    // called on a model before it is published, e.g. to enable its approximate searches
+    typedef std::function<void(ML&)> Prepare;
+
+  private:
+    struct Entry {
+      std::string path;
+      Prepare prepare;
+      std::shared_ptr<const ML> model;
+    };
+    mutable std::mutex mutex;
+    std::map<std::string, Entry> models;
+    void replace(const std::string&, Entry);
+
+  public:
+    /**
+     * Loads a model file (see ML::load) and publishes it under a name, replacing the model of that name.
+     * The file is loaded before the swap; if it cannot be loaded the exception is thrown
+     * and the previous model stays in place.
+     *
+     * @param name the name of the model
+     * @param path the model file
+     * @param prepare called on the model before it is published (kept for reload)
+     * @return the new model
+     */
+    std::shared_ptr<const ML> load(const std::string&, const std::string&, const Prepare &prepare=nullptr);
+
+    /**
+     * Loads the file of a model again (e.g. after it was retrained), as load does.
+     * Throws std::out_of_range if the name has no file.
+     *
+     * @param name the name of the model
+     * @return the new model
+     */
+    std::shared_ptr<const ML> reload(const std::string&);
+
+    /**
+     * Publishes a model built in memory under a name, replacing the model of that name.
+     *
+     * @param name the name of the model
+     * @param model the model
+     */
+    void publish(const std::string&, std::shared_ptr<const ML>);
+
+    /**
+     * @param name the name of the model
+     * @return the current model of the name, empty if there is none
+     */
+    std::shared_ptr<const ML> get(const std::string&) const;
+
+    /**
+     * Removes a model, the classifications that hold it finish with it.
+     *
+     * @param name the name of the model
+     * @return true if the name had a model
+     */
+    bool remove(const std::string&);
+
+    /**
+     * @return the names of the models, sorted
+     */
+    std::vector<std::string> names() const;
+};
+
+#endif
@@ -0,0 +1,82 @@
+/**
+ * @file lib_mt.h
+ * @brief Multi-Threading library
+ *
+ * Minimal helpers to spread independent work items over a fixed number of threads.
+ * Work is handed out through an atomic counter, so workers never wait on each other.
+ *
+ * @author $Author: Catarina Silva $
+ * @version $Revision: 1.0 $
+ * @date $Date: 2020/10/12 $
+ */
+
+#ifndef MT_H
+#define MT_H
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <thread>
+#include <vector>
+
+/**
+ * Resolves the number of workers to use, never more than the hardware threads.
+ *
+ * @param requested number of workers requested by the user (0 means one per hardware thread)
+ * @return number of workers, at least one
+ */
+inline unsigned int worker_count(const unsigned int requested) {
+  const unsigned int hardware = std::max(1u, std::thread::hardware_concurrency());
+  return requested > 0 ? std::min(requested, hardware) : hardware;
+}
+
+/**
+ * Calls f(i, worker) for every i in [0, n) using the given number of workers.
+ * With a single worker everything runs on the calling thread.
+ * The worker index (in [0, workers)) allows the caller to keep per-worker state without locks.
+ * The first exception thrown by f is rethrown on the calling thread after all workers finish.
+ *
+ * @param n number of work items
+ * @param workers number of worker threads
+ * @param f function called as f(size_t item, unsigned int worker)
+ */
+template<class F>
+void parallel_for(const size_t n, const unsigned int workers, F&& f) {
+  if(workers <= 1 || n <= 1) {
+    for(size_t i = 0; i < n; i++) {
+      f(i, 0u);
+    }
+    return;
+  }
+
+  std::atomic<size_t> next(0);
+  std::atomic<bool> failed(false);
+  std::exception_ptr error;
+  auto run = [&](const unsigned int w) {
+    try {
+      for(size_t i = next++; i < n && !failed; i = next++) {
+        f(i, w);
+      }
+    } catch(...) {
+      if(!failed.exchange(true)) {
+        error = std::current_exception();
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  const unsigned int t = static_cast<unsigned int>(std::min<size_t>(workers, n));
+  for(unsigned int w = 1; w < t; w++) {
+    threads.emplace_back(run, w);
+  }
+  run(0);
+  for(auto& thread: threads) {
+    thread.join();
+  }
+
+  if(error) {
+    std::rethrow_exception(error);
+  }
+}
+
+#endif
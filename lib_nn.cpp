@@ -0,0 +1,1232 @@
+#include "lib_nn.h"
+#include "lib_mt.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+
+// the kernel is compiled for each instruction set and the loader picks the best one for the CPU
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SIMD_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define SIMD_CLONES
+#endif
+
+// body of the kernel, inlined on each overload so every metric gets its own vectorized loops
+template<class M>
+inline __attribute__((always_inline))
+void score_rows(const M& m, const feature_t *columns, const size_t stride, const size_t n, const feature_t *query,
+double *out) {
+  #pragma omp simd
+  for(size_t i = 0; i < n; i++) {
+    out[i] = 0;
+  }
+  for(size_t j = 0; j < InstanceStore::dimensions; j++) {
+    const feature_t *c = columns + j * stride;
+    // the differences are computed on the precision of the features, as metric::surrogate
+    const feature_t q = query[j];
+    #pragma omp simd
+    for(size_t i = 0; i < n; i++) {
+      out[i] = m.reduce(out[i], m.term(c[i] - q));
+    }
+  }
+}
+
+// the powers of the general order take a loop, which is moved out of the rows:
+// each multiplication is a vectorized sweep over a block of rows
+inline __attribute__((always_inline))
+void score_rows(const metric::Lp& m, const feature_t *columns, const size_t stride, const size_t n,
+const feature_t *query, double *out) {
+  const size_t block = 256;
+  double t[block], power[block];
+  for(size_t begin = 0; begin < n; begin += block) {
+    const size_t rows = std::min(block, n - begin);
+    double *o = out + begin;
+    #pragma omp simd
+    for(size_t i = 0; i < rows; i++) {
+      o[i] = 0;
+    }
+    for(size_t j = 0; j < InstanceStore::dimensions; j++) {
+      const feature_t *c = columns + j * stride + begin;
+      const feature_t q = query[j];
+      #pragma omp simd
+      for(size_t i = 0; i < rows; i++) {
+        t[i] = power[i] = std::fabs(c[i] - q);
+      }
+      for(unsigned int e = 1; e < m.p; e++) {
+        #pragma omp simd
+        for(size_t i = 0; i < rows; i++) {
+          power[i] *= t[i];
+        }
+      }
+      #pragma omp simd
+      for(size_t i = 0; i < rows; i++) {
+        o[i] += power[i];
+      }
+    }
+  }
+}
+
+SIMD_CLONES
+void score_columns(const metric::L1& m, const feature_t *columns, const size_t stride, const size_t n,
+const feature_t *query, double *out) {
+  score_rows(m, columns, stride, n, query, out);
+}
+
+SIMD_CLONES
+void score_columns(const metric::L2& m, const feature_t *columns, const size_t stride, const size_t n,
+const feature_t *query, double *out) {
+  score_rows(m, columns, stride, n, query, out);
+}
+
+SIMD_CLONES
+void score_columns(const metric::Lp& m, const feature_t *columns, const size_t stride, const size_t n,
+const feature_t *query, double *out) {
+  score_rows(m, columns, stride, n, query, out);
+}
+
+SIMD_CLONES
+void score_columns(const metric::LInf& m, const feature_t *columns, const size_t stride, const size_t n,
+const feature_t *query, double *out) {
+  score_rows(m, columns, stride, n, query, out);
+}
+
+// terms of a block of differences (absolute, in the units of the features) added to the scores
+template<class M>
+inline __attribute__((always_inline))
+void accumulate(const M& m, const size_t n, const double *t, double *out) {
+  #pragma omp simd
+  for(size_t i = 0; i < n; i++) {
+    out[i] = m.reduce(out[i], m.term(t[i]));
+  }
+}
+
+inline __attribute__((always_inline))
+void accumulate(const metric::Lp& m, const size_t n, const double *t, double *out) {
+  double power[256];
+  #pragma omp simd
+  for(size_t i = 0; i < n; i++) {
+    power[i] = t[i];
+  }
+  for(unsigned int e = 1; e < m.p; e++) {
+    #pragma omp simd
+    for(size_t i = 0; i < n; i++) {
+      power[i] *= t[i];
+    }
+  }
+  #pragma omp simd
+  for(size_t i = 0; i < n; i++) {
+    out[i] += power[i];
+  }
+}
+
+// adds the terms of one column to the scores of n rows (at most 256)
+template<class M>
+inline __attribute__((always_inline))
+void sweep(const M& m, const feature_t *c, const feature_t q, const size_t n, double *out) {
+  #pragma omp simd
+  for(size_t i = 0; i < n; i++) {
+    out[i] = m.reduce(out[i], m.term(c[i] - q));
+  }
+}
+
+inline __attribute__((always_inline))
+void sweep(const metric::Lp& m, const feature_t *c, const feature_t q, const size_t n, double *out) {
+  double t[256];
+  #pragma omp simd
+  for(size_t i = 0; i < n; i++) {
+    t[i] = std::fabs(c[i] - q);
+  }
+  accumulate(m, n, t, out);
+}
+
+// body of the bounded kernel: the head dimensions on every row, then the rows still below the bound are gathered
+// and scored one dimension at a time, dropping the ones that cross it
+template<class M>
+inline __attribute__((always_inline))
+void bounded_rows(const M& m, const feature_t *columns, const size_t stride, const size_t n, const feature_t *query,
+const unsigned int *dims, const double bound, double *out) {
+  #pragma omp simd
+  for(size_t i = 0; i < n; i++) {
+    out[i] = 0;
+  }
+  for(size_t h = 0; h < InstanceStore::head; h++) {
+    sweep(m, columns + dims[h] * stride, query[dims[h]], n, out);
+  }
+
+  // the dimensions are summed on another order than score_rows, the margin keeps the ties with its results
+  const double limit = bound + bound * 1e-12;
+  size_t alive = 0;
+  #pragma omp simd reduction(+:alive)
+  for(size_t i = 0; i < n; i++) {
+    alive += out[i] <= limit;
+  }
+  if(alive == 0) {
+    return;
+  }
+
+  // when most rows are still below the bound, gathering them costs more than scoring every row
+  if(2 * alive > n) {
+    for(size_t h = InstanceStore::head; h < InstanceStore::dimensions; h++) {
+      sweep(m, columns + dims[h] * stride, query[dims[h]], n, out);
+    }
+    return;
+  }
+
+  unsigned int rows[256];
+  double partial[256], t[256];
+  alive = 0;
+  for(size_t i = 0; i < n; i++) {
+    if(out[i] <= limit) {
+      rows[alive] = i;
+      partial[alive++] = out[i];
+    }
+  }
+  for(size_t h = InstanceStore::head; h < InstanceStore::dimensions && alive > 0; h++) {
+    const feature_t *c = columns + dims[h] * stride;
+    const feature_t q = query[dims[h]];
+    #pragma omp simd
+    for(size_t a = 0; a < alive; a++) {
+      t[a] = std::fabs(c[rows[a]] - q);
+    }
+    accumulate(m, alive, t, partial);
+    size_t kept = 0;
+    for(size_t a = 0; a < alive; a++) {
+      out[rows[a]] = partial[a];
+      if(partial[a] <= limit) {
+        rows[kept] = rows[a];
+        partial[kept++] = partial[a];
+      }
+    }
+    alive = kept;
+  }
+}
+
+SIMD_CLONES
+void score_bounded_columns(const metric::L1& m, const feature_t *columns, const size_t stride, const size_t n,
+const feature_t *query, const unsigned int *dims, const double bound, double *out) {
+  bounded_rows(m, columns, stride, n, query, dims, bound, out);
+}
+
+SIMD_CLONES
+void score_bounded_columns(const metric::L2& m, const feature_t *columns, const size_t stride, const size_t n,
+const feature_t *query, const unsigned int *dims, const double bound, double *out) {
+  bounded_rows(m, columns, stride, n, query, dims, bound, out);
+}
+
+SIMD_CLONES
+void score_bounded_columns(const metric::Lp& m, const feature_t *columns, const size_t stride, const size_t n,
+const feature_t *query, const unsigned int *dims, const double bound, double *out) {
+  bounded_rows(m, columns, stride, n, query, dims, bound, out);
+}
+
+SIMD_CLONES
+void score_bounded_columns(const metric::LInf& m, const feature_t *columns, const size_t stride, const size_t n,
+const feature_t *query, const unsigned int *dims, const double bound, double *out) {
+  bounded_rows(m, columns, stride, n, query, dims, bound, out);
+}
+
+// products of a block of rows with dot_queries queries, each value of the columns is loaded once for all of them
+SIMD_CLONES
+void dot_columns(const feature_t *columns, const size_t stride, const size_t n, const feature_t *const *query,
+double *out) {
+  static_assert(InstanceStore::dot_queries == 4, "the kernel computes 4 products per value");
+  double *o0 = out, *o1 = out + n, *o2 = out + 2 * n, *o3 = out + 3 * n;
+  #pragma omp simd
+  for(size_t i = 0; i < 4 * n; i++) {
+    out[i] = 0;
+  }
+  for(size_t j = 0; j < InstanceStore::dimensions; j++) {
+    const feature_t *c = columns + j * stride;
+    const double q0 = query[0][j], q1 = query[1][j], q2 = query[2][j], q3 = query[3][j];
+    #pragma omp simd
+    for(size_t i = 0; i < n; i++) {
+      const double v = c[i];
+      o0[i] += v * q0;
+      o1[i] += v * q1;
+      o2[i] += v * q2;
+      o3[i] += v * q3;
+    }
+  }
+}
+
+const char* simd_kernel() {
+#if defined(__GNUC__) && defined(__x86_64__)
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512f")) {
+    return "avx512f";
+  }
+  if(__builtin_cpu_supports("avx2")) {
+    return "avx2";
+  }
+#endif
+  return "scalar";
+}
+
+InstanceStore::InstanceStore() : rows(0), stride(0), columns(nullptr), norms(nullptr) {
+  std::iota(by_variance.begin(), by_variance.end(), 0);
+}
+
+// values of a store built in memory
+struct StoreBuffer {
+  std::vector<feature_t> columns;
+  std::vector<double> norms;
+};
+
+InstanceStore::InstanceStore(const std::vector<FeatureVector> &points) {
+  rows = points.size();
+  // the columns start on a multiple of 16 values
+  stride = (rows + 15) / 16 * 16;
+  auto buffer = std::make_shared<StoreBuffer>();
+  auto &values = buffer->columns;
+  values.assign(dimensions * stride, 0);
+  for(size_t i = 0; i < rows; i++) {
+    for(size_t j = 0; j < dimensions; j++) {
+      values[j * stride + i] = points[i][j + 1];
+    }
+  }
+  buffer->norms.assign(rows, 0);
+  for(size_t j = 0; j < dimensions; j++) {
+    for(size_t i = 0; i < rows; i++) {
+      const double v = values[j * stride + i];
+      buffer->norms[i] += v * v;
+    }
+  }
+  columns = values.data();
+  norms = buffer->norms.data();
+  owner = buffer;
+
+  std::array<double, dimensions> variance;
+  for(size_t j = 0; j < dimensions; j++) {
+    double sum = 0, squares = 0;
+    for(size_t i = 0; i < rows; i++) {
+      const double v = values[j * stride + i];
+      sum += v;
+      squares += v * v;
+    }
+    const double mean = rows > 0 ? sum / rows : 0.0;
+    variance[j] = rows > 0 ? squares / rows - mean * mean : 0.0;
+  }
+  std::iota(by_variance.begin(), by_variance.end(), 0);
+  std::stable_sort(by_variance.begin(), by_variance.end(), [&](const unsigned int a, const unsigned int b) {
+    return variance[a] > variance[b];
+  });
+}
+
+// copies values stored with another precision than feature_t
+template<class T>
+void convert_values(ModelReader &reader, const size_t count, std::vector<feature_t> &out) {
+  const T *values = reader.view<T>(count);
+  out.assign(values, values + count);
+}
+
+InstanceStore::InstanceStore(const std::shared_ptr<const MappedFile> &file, ModelReader &reader,
+const size_t _rows, const size_t feature_bytes) {
+  rows = _rows;
+  stride = (rows + 15) / 16 * 16;
+  unsigned int seen = 0;
+  for(auto &j: by_variance) {
+    j = reader.get<uint32_t>();
+    if(j >= dimensions || (seen & (1u << j))) {
+      throw std::runtime_error("corrupted model file");
+    }
+    seen |= 1u << j;
+  }
+  reader.align();
+
+  if(feature_bytes == sizeof(feature_t)) {
+    columns = reader.view<feature_t>(dimensions * stride);
+    reader.align();
+    norms = reader.view<double>(rows);
+    owner = file;
+    return;
+  }
+
+  auto buffer = std::make_shared<StoreBuffer>();
+  if(feature_bytes == sizeof(float)) {
+    convert_values<float>(reader, dimensions * stride, buffer->columns);
+  } else if(feature_bytes == sizeof(double)) {
+    convert_values<double>(reader, dimensions * stride, buffer->columns);
+  } else {
+    throw std::runtime_error("unsupported feature size: " + std::to_string(feature_bytes));
+  }
+  reader.align();
+  const double *stored = reader.view<double>(rows);
+  buffer->norms.assign(stored, stored + rows);
+  columns = buffer->columns.data();
+  norms = buffer->norms.data();
+  owner = buffer;
+}
+
+void InstanceStore::store(std::ostream &o) const {
+  for(auto j: by_variance) {
+    put<uint32_t>(o, j);
+  }
+  pad(o);
+  o.write(reinterpret_cast<const char*>(columns), dimensions * stride * sizeof(feature_t));
+  pad(o);
+  o.write(reinterpret_cast<const char*>(norms), rows * sizeof(double));
+}
+
+void InstanceStore::dot(const FeatureVector *const *queries, const size_t begin, const size_t end,
+double *out) const {
+  const feature_t *q[dot_queries];
+  for(size_t i = 0; i < dot_queries; i++) {
+    q[i] = queries[i]->values + 1;
+  }
+  dot_columns(columns + begin, stride, end - begin, q, out);
+}
+
+double InstanceStore::norm(const size_t i) const {
+  return norms[i];
+}
+
+FeatureVector InstanceStore::point(const size_t i) const {
+  FeatureVector rv{};
+  rv[0] = 1.0;
+  for(size_t j = 0; j < dimensions; j++) {
+    rv[j + 1] = columns[j * stride + i];
+  }
+  return rv;
+}
+
+size_t InstanceStore::size() const {
+  return rows;
+}
+
+// adds a candidate to a max-heap of the k nearest neighbours found
+static inline void offer(std::vector<Neighbour> &heap, const Neighbour &candidate, const size_t k) {
+  if(heap.size() < k) {
+    heap.push_back(candidate);
+    std::push_heap(heap.begin(), heap.end());
+  } else if(candidate < heap.front()) {
+    std::pop_heap(heap.begin(), heap.end());
+    heap.back() = candidate;
+    std::push_heap(heap.begin(), heap.end());
+  }
+}
+
+// body of the kernel over the codes, on blocks of at most 256 rows:
+// the query is given in codes, so each difference takes a conversion and a multiplication by the scale
+template<class M>
+inline __attribute__((always_inline))
+void score_code_rows(const M& m, const uint8_t *columns, const size_t stride, const size_t n, const float *query,
+const float *scale, double *out) {
+  double t[256];
+  #pragma omp simd
+  for(size_t i = 0; i < n; i++) {
+    out[i] = 0;
+  }
+  for(size_t j = 0; j < QuantizedStore::dimensions; j++) {
+    const uint8_t *c = columns + j * stride;
+    const float q = query[j], s = scale[j];
+    #pragma omp simd
+    for(size_t i = 0; i < n; i++) {
+      t[i] = std::fabs((static_cast<float>(c[i]) - q) * s);
+    }
+    accumulate(m, n, t, out);
+  }
+}
+
+SIMD_CLONES
+void score_codes(const metric::L1& m, const uint8_t *columns, const size_t stride, const size_t n,
+const float *query, const float *scale, double *out) {
+  score_code_rows(m, columns, stride, n, query, scale, out);
+}
+
+SIMD_CLONES
+void score_codes(const metric::L2& m, const uint8_t *columns, const size_t stride, const size_t n,
+const float *query, const float *scale, double *out) {
+  score_code_rows(m, columns, stride, n, query, scale, out);
+}
+
+SIMD_CLONES
+void score_codes(const metric::Lp& m, const uint8_t *columns, const size_t stride, const size_t n,
+const float *query, const float *scale, double *out) {
+  score_code_rows(m, columns, stride, n, query, scale, out);
+}
+
+SIMD_CLONES
+void score_codes(const metric::LInf& m, const uint8_t *columns, const size_t stride, const size_t n,
+const float *query, const float *scale, double *out) {
+  score_code_rows(m, columns, stride, n, query, scale, out);
+}
+
+// the range of each dimension over the points, split on 255 steps
+static void fit(const std::vector<FeatureVector> &points, QuantizedStore::Parameters &scale,
+QuantizedStore::Parameters &offset) {
+  for(size_t j = 0; j < QuantizedStore::dimensions; j++) {
+    double low = 0, high = 0;
+    for(size_t i = 0; i < points.size(); i++) {
+      const double v = points[i][j + 1];
+      if(i == 0 || v < low) {
+        low = v;
+      }
+      if(i == 0 || v > high) {
+        high = v;
+      }
+    }
+    offset[j] = low;
+    // a constant dimension has a single code
+    scale[j] = high > low ? (high - low) / 255.0 : 1.0;
+  }
+}
+
+QuantizedStore::QuantizedStore(const std::vector<FeatureVector> &points, const unsigned int _d) {
+  Parameters _scale, _offset;
+  fit(points, _scale, _offset);
+  *this = QuantizedStore(points, _d, _scale, _offset);
+}
+
+QuantizedStore::QuantizedStore(const std::vector<FeatureVector> &points, const unsigned int _d,
+const Parameters &_scale, const Parameters &_offset) {
+  rows = points.size();
+  // the columns start on a multiple of 64 codes (a cache line)
+  stride = (rows + 63) / 64 * 64;
+  auto buffer = std::make_shared<std::vector<uint8_t>>(dimensions * stride, 0);
+  scale = _scale;
+  offset = _offset;
+  d = _d;
+  for(size_t i = 0; i < rows; i++) {
+    for(size_t j = 0; j < dimensions; j++) {
+      const double code = std::round((points[i][j + 1] - offset[j]) / scale[j]);
+      (*buffer)[j * stride + i] = static_cast<uint8_t>(std::min(std::max(code, 0.0), 255.0));
+    }
+  }
+  columns = buffer->data();
+  owner = buffer;
+}
+
+QuantizedStore::QuantizedStore(const std::shared_ptr<const MappedFile> &file, ModelReader &reader,
+const size_t _rows, const unsigned int _d) {
+  rows = _rows;
+  stride = (rows + 63) / 64 * 64;
+  d = _d;
+  for(auto &v: scale) {
+    v = reader.get<double>();
+  }
+  for(auto &v: offset) {
+    v = reader.get<double>();
+  }
+  reader.align();
+  columns = reader.view<uint8_t>(dimensions * stride);
+  owner = file;
+}
+
+void QuantizedStore::store(std::ostream &o) const {
+  for(auto v: scale) {
+    put<double>(o, v);
+  }
+  for(auto v: offset) {
+    put<double>(o, v);
+  }
+  pad(o);
+  o.write(reinterpret_cast<const char*>(columns), dimensions * stride);
+}
+
+std::vector<Neighbour> QuantizedStore::search(const FeatureVector &query, const size_t k) const {
+  std::vector<Neighbour> heap;
+  if(k == 0 || rows == 0) {
+    return heap;
+  }
+  heap.reserve(k);
+
+  // the query in codes, not rounded nor clamped
+  float q[dimensions], s[dimensions];
+  for(size_t j = 0; j < dimensions; j++) {
+    q[j] = (query[j + 1] - offset[j]) / scale[j];
+    s[j] = scale[j];
+  }
+
+  metric::dispatch(d, [&](auto m) {
+    const size_t block = 256;
+    double scores[block];
+    for(size_t begin = 0; begin < rows; begin += block) {
+      const size_t n = std::min(block, rows - begin);
+      score_codes(m, columns + begin, stride, n, q, s, scores);
+      for(size_t i = 0; i < n; i++) {
+        offer(heap, Neighbour{scores[i], static_cast<unsigned int>(begin + i)}, k);
+      }
+    }
+    return 0;
+  });
+
+  std::sort_heap(heap.begin(), heap.end());
+  return heap;
+}
+
+std::array<uint8_t, QuantizedStore::dimensions> QuantizedStore::codes(const size_t i) const {
+  std::array<uint8_t, dimensions> rv;
+  for(size_t j = 0; j < dimensions; j++) {
+    rv[j] = columns[j * stride + i];
+  }
+  return rv;
+}
+
+FeatureVector QuantizedStore::dequantize(const size_t i) const {
+  FeatureVector rv;
+  std::fill(std::begin(rv.values), std::end(rv.values), 0);
+  rv[0] = 1.0;
+  for(size_t j = 0; j < dimensions; j++) {
+    rv[j + 1] = offset[j] + columns[j * stride + i] * scale[j];
+  }
+  return rv;
+}
+
+const QuantizedStore::Parameters& QuantizedStore::get_scale() const {
+  return scale;
+}
+
+const QuantizedStore::Parameters& QuantizedStore::get_offset() const {
+  return offset;
+}
+
+size_t QuantizedStore::size() const {
+  return rows;
+}
+
+struct KDTree::Buffer {
+  static_assert(sizeof(Node) == 32, "the nodes are stored as they are in memory");
+  std::vector<uint32_t> order, position;
+  std::vector<Node> nodes;
+};
+
+KDTree::KDTree(const std::vector<FeatureVector> &_points, const unsigned int _d, const unsigned int leaf_size) {
+  d = _d;
+  searcher = metric::dispatch(d, [](auto m) {
+    return &KDTree::find<decltype(m)>;
+  });
+
+  auto buffer = std::make_shared<Buffer>();
+  buffer->order.resize(_points.size());
+  std::iota(buffer->order.begin(), buffer->order.end(), 0);
+  max_leaf = 0;
+  if(!_points.empty()) {
+    build(_points, *buffer, 0, _points.size(), std::max(leaf_size, 1u));
+  }
+
+  // the points are stored on the order of the tree, so each leaf is contiguous
+  std::vector<FeatureVector> sorted;
+  sorted.reserve(buffer->order.size());
+  for(auto i: buffer->order) {
+    sorted.push_back(_points[i]);
+  }
+  points = InstanceStore(sorted);
+  buffer->position.resize(buffer->order.size());
+  for(unsigned int i = 0; i < buffer->order.size(); i++) {
+    buffer->position[buffer->order[i]] = i;
+  }
+  order = buffer->order.data();
+  position = buffer->position.data();
+  nodes = buffer->nodes.data();
+  node_count = buffer->nodes.size();
+  owner = buffer;
+}
+
+KDTree::KDTree(const std::shared_ptr<const MappedFile> &file, ModelReader &reader, const unsigned int _d) {
+  d = _d;
+  searcher = metric::dispatch(d, [](auto m) {
+    return &KDTree::find<decltype(m)>;
+  });
+
+  const uint32_t count = reader.get<uint32_t>();
+  node_count = reader.get<uint32_t>();
+  const uint32_t feature_bytes = reader.get<uint32_t>();
+  reader.align();
+
+  // position inverts order on every point only if order is a permutation
+  order = reader.view<uint32_t>(count);
+  reader.align();
+  position = reader.view<uint32_t>(count);
+  for(unsigned int i = 0; i < count; i++) {
+    if(order[i] >= count || position[order[i]] != i) {
+      throw std::runtime_error("corrupted model file");
+    }
+  }
+  reader.align();
+
+  nodes = reader.view<Node>(node_count);
+  max_leaf = 0;
+  for(uint32_t i = 0; i < node_count; i++) {
+    const Node &n = nodes[i];
+    const bool leaf = n.axis < 0;
+    if(n.begin > n.end || n.end > count || n.axis >= static_cast<int>(FeatureVector::length) ||
+      (!leaf && (n.left <= static_cast<int>(i) || n.right <= static_cast<int>(i) ||
+      n.left >= static_cast<int>(node_count) || n.right >= static_cast<int>(node_count)))) {
+      throw std::runtime_error("corrupted model file");
+    }
+    if(leaf) {
+      max_leaf = std::max<size_t>(max_leaf, n.end - n.begin);
+    }
+  }
+  if((count > 0) != (node_count > 0)) {
+    throw std::runtime_error("corrupted model file");
+  }
+  reader.align();
+
+  points = InstanceStore(file, reader, count, feature_bytes);
+  owner = file;
+}
+
+void KDTree::store(std::ostream &o) const {
+  put<uint32_t>(o, size());
+  put<uint32_t>(o, node_count);
+  put<uint32_t>(o, sizeof(feature_t));
+  pad(o);
+  o.write(reinterpret_cast<const char*>(order), size() * sizeof(uint32_t));
+  pad(o);
+  o.write(reinterpret_cast<const char*>(position), size() * sizeof(uint32_t));
+  pad(o);
+  o.write(reinterpret_cast<const char*>(nodes), node_count * sizeof(Node));
+  pad(o);
+  points.store(o);
+}
+
+int KDTree::build(const std::vector<FeatureVector> &input, Buffer &buffer, const unsigned int begin,
+const unsigned int end, const unsigned int leaf_size) {
+  auto &order = buffer.order;
+  auto &nodes = buffer.nodes;
+  const int rv = nodes.size();
+  nodes.push_back(Node{begin, end, -1, -1, -1, 0, 0});
+
+  int axis = -1;
+  if(end - begin > leaf_size) {
+    double spread = 0;
+    for(size_t j = 0; j < FeatureVector::length; j++) {
+      auto range = std::minmax_element(order.begin() + begin, order.begin() + end,
+        [&](const unsigned int a, const unsigned int b) { return input[a][j] < input[b][j]; });
+      const double s = input[*range.second][j] - input[*range.first][j];
+      if(s > spread) {
+        spread = s;
+        axis = j;
+      }
+    }
+  }
+  // small nodes and nodes where every point is equal are leaves
+  if(axis < 0) {
+    max_leaf = std::max<size_t>(max_leaf, end - begin);
+    return rv;
+  }
+
+  const unsigned int mid = begin + (end - begin) / 2;
+  std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+    [&](const unsigned int a, const unsigned int b) { return input[a][axis] < input[b][axis]; });
+  const feature_t split = input[order[mid]][axis];
+
+  const int left = build(input, buffer, begin, mid, leaf_size), right = build(input, buffer, mid, end, leaf_size);
+  nodes[rv].axis = axis;
+  nodes[rv].split = split;
+  nodes[rv].left = left;
+  nodes[rv].right = right;
+  return rv;
+}
+
+template<class M>
+void KDTree::descend(const M& m, const int n, const FeatureVector &query, const size_t k,
+std::vector<Neighbour> &heap, std::vector<double> &scores, size_t &scored) const {
+  const Node &node = nodes[n];
+  if(node.axis < 0) {
+    scored += node.end - node.begin;
+    // once k neighbours are found, the points farther than all of them are abandoned early
+    for(unsigned int b = node.begin; b < node.end; b += block) {
+      const unsigned int e = std::min<unsigned int>(node.end, b + block);
+      if(heap.size() < k) {
+        points.score(m, query, b, e, scores.data());
+      } else {
+        points.score_bounded(m, query, b, e, heap.front().distance, scores.data());
+      }
+      for(unsigned int i = b; i < e; i++) {
+        offer(heap, Neighbour{scores[i - b], order[i]}, k);
+      }
+    }
+    return;
+  }
+
+  const double diff = query[node.axis] - node.split;
+  descend(m, diff < 0 ? node.left : node.right, query, k, heap, scores, scored);
+  // the points on the other side are at least |diff| away on the split dimension
+  // (a tie with a lower index can still enter the heap)
+  if(heap.size() < k || m.term(diff) <= heap.front().distance) {
+    descend(m, diff < 0 ? node.right : node.left, query, k, heap, scores, scored);
+  }
+}
+
+template<class M>
+std::vector<Neighbour> KDTree::find(const FeatureVector &query, const size_t k, size_t &scored) const {
+  std::vector<Neighbour> heap;
+  if(k == 0 || node_count == 0) {
+    return heap;
+  }
+  heap.reserve(k);
+  std::vector<double> scores(std::min(max_leaf, block));
+  const M m(d);
+  descend(m, 0, query, k, heap, scores, scored);
+  rescore(m, query, heap);
+  std::sort_heap(heap.begin(), heap.end());
+  return heap;
+}
+
+std::vector<Neighbour> KDTree::search(const FeatureVector &query, const size_t k) const {
+  size_t scored = 0;
+  return (this->*searcher)(query, k, scored);
+}
+
+template<class M>
+void KDTree::rescore(const M& m, const FeatureVector &query, std::vector<Neighbour> &heap) const {
+  // the neighbours are scored again as score does, on the order of the dimensions,
+  // so every search returns the same distances
+  for(auto &neighbour: heap) {
+    const size_t p = position[neighbour.index];
+    points.score(m, query, p, p + 1, &neighbour.distance);
+  }
+  std::make_heap(heap.begin(), heap.end());
+}
+
+template<class M>
+void KDTree::scan(const M& m, const std::vector<FeatureVector> &queries, const size_t begin, const size_t end,
+const size_t k, std::vector<std::vector<Neighbour>> &rv) const {
+  double scores[block];
+  // each block of points is scored against every query of the tile while it is in cache
+  // (on every dimension: the partial distance search of find costs more than it saves on these sweeps)
+  for(size_t r = 0; r < points.size(); r += block) {
+    const size_t rows = std::min(block, points.size() - r);
+    for(size_t q = begin; q < end; q++) {
+      points.score(m, queries[q], r, r + rows, scores);
+      for(size_t i = 0; i < rows; i++) {
+        offer(rv[q], Neighbour{scores[i], order[r + i]}, k);
+      }
+    }
+  }
+}
+
+void KDTree::scan(const metric::L2& m, const std::vector<FeatureVector> &queries, const size_t begin,
+const size_t end, const size_t k, std::vector<std::vector<Neighbour>> &rv) const {
+  const size_t n = InstanceStore::dot_queries;
+  // the queries of the tile in groups of n (the last group repeats its last query) and their squared norms
+  const size_t groups = (end - begin + n - 1) / n;
+  std::vector<const FeatureVector*> group(groups * n);
+  std::vector<double> norms(groups * n, 0);
+  for(size_t i = 0; i < group.size(); i++) {
+    group[i] = &queries[begin + std::min(i, end - begin - 1)];
+    for(size_t j = 1; j < FeatureVector::length; j++) {
+      const double v = (*group[i])[j];
+      norms[i] += v * v;
+    }
+  }
+
+  double dots[n * block];
+  for(size_t r = 0; r < points.size(); r += block) {
+    const size_t rows = std::min(block, points.size() - r);
+    for(size_t g = 0; g < groups; g++) {
+      points.dot(&group[g * n], r, r + rows, dots);
+      for(size_t i = 0; i < n && begin + g * n + i < end; i++) {
+        auto &heap = rv[begin + g * n + i];
+        const double *dot = dots + i * rows;
+        for(size_t x = 0; x < rows; x++) {
+          // the expansion can round below 0 for points equal to the query
+          const double s = std::max(0.0, norms[g * n + i] + points.norm(r + x) - 2.0 * dot[x]);
+          offer(heap, Neighbour{s, order[r + x]}, k);
+        }
+      }
+    }
+  }
+
+  // the expansion loses precision to cancellation, the neighbours found are scored again on the differences
+  for(size_t q = begin; q < end; q++) {
+    rescore(m, queries[q], rv[q]);
+  }
+}
+
+std::vector<std::vector<Neighbour>> KDTree::search_batch(const std::vector<FeatureVector> &queries, const size_t k,
+const unsigned int workers) const {
+  std::vector<std::vector<Neighbour>> rv(queries.size());
+  if(k == 0 || node_count == 0) {
+    return rv;
+  }
+
+  // the first queries tell how well the tree prunes these queries (a small batch is only searched on the tree)
+  const size_t sample = std::min(queries.size(), probe);
+  std::vector<size_t> scored(sample, 0);
+  parallel_for(sample, workers, [&](const size_t q, const unsigned int) {
+    rv[q] = (this->*searcher)(queries[q], k, scored[q]);
+  });
+  const double cost = std::accumulate(scored.begin(), scored.end(), 0.0) * scan_ratio;
+  if(cost < static_cast<double>(sample) * points.size()) {
+    parallel_for(queries.size() - sample, workers, [&](const size_t q, const unsigned int) {
+      size_t count = 0;
+      rv[sample + q] = (this->*searcher)(queries[sample + q], k, count);
+    });
+    return rv;
+  }
+
+  const size_t tile = 16;
+  metric::dispatch(d, [&](auto m) {
+    parallel_for((queries.size() - sample + tile - 1) / tile, workers, [&](const size_t t, const unsigned int) {
+      const size_t begin = sample + t * tile, end = std::min(queries.size(), begin + tile);
+      for(size_t q = begin; q < end; q++) {
+        rv[q].reserve(k);
+      }
+      scan(m, queries, begin, end, k, rv);
+      for(size_t q = begin; q < end; q++) {
+        std::sort_heap(rv[q].begin(), rv[q].end());
+      }
+    });
+    return 0;
+  });
+  return rv;
+}
+
+double KDTree::distance(const double surrogate) const {
+  return metric::dispatch(d, [surrogate](auto m) {
+    return m.distance(surrogate);
+  });
+}
+
+FeatureVector KDTree::point(const size_t i) const {
+  return points.point(position[i]);
+}
+
+size_t KDTree::size() const {
+  return points.size();
+}
+
+// marks of the nodes visited by the current search of the calling thread, cleared by moving to a new epoch
+static std::vector<unsigned int>& visited_marks(const size_t n, unsigned int &epoch) {
+  thread_local std::vector<unsigned int> marks;
+  thread_local unsigned int current = 0;
+  if(marks.size() < n) {
+    marks.resize(n, 0);
+  }
+  if(++current == 0) {
+    std::fill(marks.begin(), marks.end(), 0);
+    current = 1;
+  }
+  epoch = current;
+  return marks;
+}
+
+struct HNSW::Buffer {
+  std::vector<uint32_t> base, offsets, upper;
+};
+
+HNSW::HNSW(const std::shared_ptr<const KDTree> &_points, const unsigned int _d, const unsigned int _M,
+const unsigned int ef_construction) {
+  points = _points;
+  d = _d;
+  M = std::max(_M, 2u);
+  entry = 0;
+  top = -1;
+
+  // the layer of each point follows a geometric distribution, each layer has about 1/M of the points of the one below
+  std::mt19937 rng(42);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  const double scale = 1.0 / std::log(static_cast<double>(M));
+  const size_t n = points->size();
+  std::vector<int> levels(n);
+  auto buffer = std::make_shared<Buffer>();
+  buffer->offsets.assign(n + 1, 0);
+  for(size_t i = 0; i < n; i++) {
+    levels[i] = std::min(static_cast<int>(-std::log(1.0 - uniform(rng)) * scale), 16);
+    buffer->offsets[i + 1] = buffer->offsets[i] + levels[i] * (M + 1);
+  }
+  buffer->base.assign(n * (2 * M + 1), 0);
+  buffer->upper.assign(buffer->offsets[n], 0);
+  use(buffer);
+
+  metric::dispatch(d, [&](auto m) {
+    for(unsigned int i = 0; i < n; i++) {
+      insert(m, *buffer, i, levels[i], std::max(ef_construction, M));
+    }
+    return 0;
+  });
+}
+
+void HNSW::use(const std::shared_ptr<Buffer> &buffer) {
+  base = buffer->base.data();
+  offsets = buffer->offsets.data();
+  upper = buffer->upper.data();
+  owner = buffer;
+}
+
+int HNSW::level(const unsigned int node) const {
+  // the offsets of a mapped graph are not checked when loaded, a node out of order has no upper layers
+  const uint32_t begin = offsets[node], end = offsets[node + 1];
+  return begin <= end && end <= offsets[size()] ? (end - begin) / (M + 1) : 0;
+}
+
+const uint32_t* HNSW::links(const unsigned int node, const int l) const {
+  return l == 0 ? base + static_cast<size_t>(node) * (2 * M + 1) : upper + offsets[node] + (l - 1) * (M + 1);
+}
+
+uint32_t* HNSW::links(Buffer &buffer, const unsigned int node, const int l) const {
+  return l == 0 ? &buffer.base[static_cast<size_t>(node) * (2 * M + 1)] :
+    &buffer.upper[buffer.offsets[node] + (l - 1) * (M + 1)];
+}
+
+template<class Metric>
+std::vector<Neighbour> HNSW::search_layer(const Metric &m, const FeatureVector &query,
+const std::vector<Neighbour> &entries, const size_t ef, const int l) const {
+  const size_t n = size();
+  unsigned int epoch;
+  auto &marks = visited_marks(n, epoch);
+  // the candidates to expand (nearest first) and the ef nearest points found (farthest first)
+  std::vector<Neighbour> candidates, results;
+  auto nearest_first = [](const Neighbour &a, const Neighbour &b) { return b < a; };
+  for(auto &e: entries) {
+    marks[e.index] = epoch;
+    candidates.push_back(e);
+    results.push_back(e);
+  }
+  std::make_heap(candidates.begin(), candidates.end(), nearest_first);
+  std::make_heap(results.begin(), results.end());
+  while(results.size() > ef) {
+    std::pop_heap(results.begin(), results.end());
+    results.pop_back();
+  }
+
+  const unsigned int capacity = l == 0 ? 2 * M : M;
+  while(!candidates.empty()) {
+    const Neighbour c = candidates.front();
+    if(results.size() >= ef && results.front() < c) {
+      break;
+    }
+    std::pop_heap(candidates.begin(), candidates.end(), nearest_first);
+    candidates.pop_back();
+
+    // the links are checked as they are followed: a mapped graph is not read when loaded
+    const uint32_t *list = links(c.index, l);
+    const unsigned int count = std::min<uint32_t>(list[0], capacity);
+    for(unsigned int j = 1; j <= count; j++) {
+      const unsigned int e = list[j];
+      if(e >= n || marks[e] == epoch || (l > 0 && level(e) < l)) {
+        continue;
+      }
+      marks[e] = epoch;
+      const Neighbour neighbour{metric::surrogate(m, query, points->point(e)), e};
+      if(results.size() < ef || neighbour < results.front()) {
+        candidates.push_back(neighbour);
+        std::push_heap(candidates.begin(), candidates.end(), nearest_first);
+        results.push_back(neighbour);
+        std::push_heap(results.begin(), results.end());
+        if(results.size() > ef) {
+          std::pop_heap(results.begin(), results.end());
+          results.pop_back();
+        }
+      }
+    }
+  }
+
+  std::sort_heap(results.begin(), results.end());
+  return results;
+}
+
+template<class Metric>
+std::vector<Neighbour> HNSW::select(const Metric &m, const std::vector<Neighbour> &candidates,
+const size_t count) const {
+  // a candidate is kept only if it is nearer to the node than to every kept candidate,
+  // which spreads the links over different directions
+  std::vector<Neighbour> rv;
+  std::vector<FeatureVector> kept;
+  for(auto &c: candidates) {
+    const FeatureVector point = points->point(c.index);
+    bool keep = true;
+    for(auto &k: kept) {
+      if(metric::surrogate(m, point, k) < c.distance) {
+        keep = false;
+        break;
+      }
+    }
+    if(keep) {
+      rv.push_back(c);
+      if(rv.size() == count) {
+        break;
+      }
+      kept.push_back(point);
+    }
+  }
+  return rv;
+}
+
+template<class Metric>
+void HNSW::insert(const Metric &m, Buffer &buffer, const unsigned int node, const int l,
+const unsigned int ef_construction) {
+  if(top < 0) {
+    entry = node;
+    top = l;
+    return;
+  }
+
+  const FeatureVector query = points->point(node);
+  std::vector<Neighbour> nearest{Neighbour{metric::surrogate(m, query, points->point(entry)), entry}};
+  for(int layer = top; layer > l; layer--) {
+    nearest = search_layer(m, query, nearest, 1, layer);
+  }
+
+  for(int layer = std::min(l, top); layer >= 0; layer--) {
+    nearest = search_layer(m, query, nearest, ef_construction, layer);
+    const auto selected = select(m, nearest, M);
+    uint32_t *list = links(buffer, node, layer);
+    list[0] = selected.size();
+    for(size_t j = 0; j < selected.size(); j++) {
+      list[j + 1] = selected[j].index;
+    }
+
+    // the links are symmetric, a node with too many links keeps the ones chosen by select
+    const unsigned int capacity = layer == 0 ? 2 * M : M;
+    for(auto &s: selected) {
+      uint32_t *other = links(buffer, s.index, layer);
+      if(other[0] < capacity) {
+        other[++other[0]] = node;
+        continue;
+      }
+      const FeatureVector point = points->point(s.index);
+      std::vector<Neighbour> candidates{Neighbour{s.distance, node}};
+      for(unsigned int j = 1; j <= other[0]; j++) {
+        candidates.push_back(Neighbour{metric::surrogate(m, point, points->point(other[j])), other[j]});
+      }
+      std::sort(candidates.begin(), candidates.end());
+      const auto kept = select(m, candidates, capacity);
+      other[0] = kept.size();
+      for(size_t j = 0; j < kept.size(); j++) {
+        other[j + 1] = kept[j].index;
+      }
+    }
+  }
+
+  if(l > top) {
+    entry = node;
+    top = l;
+  }
+}
+
+template<class Metric>
+std::vector<Neighbour> HNSW::find(const Metric &m, const FeatureVector &query, const size_t k,
+const size_t ef) const {
+  std::vector<Neighbour> nearest{Neighbour{metric::surrogate(m, query, points->point(entry)), entry}};
+  for(int layer = top; layer > 0; layer--) {
+    nearest = search_layer(m, query, nearest, 1, layer);
+  }
+  nearest = search_layer(m, query, nearest, std::max(ef, k), 0);
+  if(nearest.size() > k) {
+    nearest.resize(k);
+  }
+  return nearest;
+}
+
+std::vector<Neighbour> HNSW::search(const FeatureVector &query, const size_t k, const size_t ef) const {
+  if(k == 0 || top < 0) {
+    return std::vector<Neighbour>();
+  }
+  return metric::dispatch(d, [&](auto m) {
+    return find(m, query, k, ef);
+  });
+}
+
+// header of the graph files
+const char hnsw_magic[4] = {'H', 'N', 'S', 'W'};
+const uint32_t hnsw_version = 2;
+
+void HNSW::store(const std::string &path) const {
+  std::ofstream o(path, std::ios::binary);
+  store(o);
+}
+
+void HNSW::store(std::ostream &o) const {
+  const size_t n = size();
+  o.write(hnsw_magic, sizeof(hnsw_magic));
+  put<uint32_t>(o, hnsw_version);
+  put<uint32_t>(o, n);
+  put<uint32_t>(o, d);
+  put<uint32_t>(o, M);
+  put<uint32_t>(o, entry);
+  put<uint32_t>(o, static_cast<uint32_t>(top));
+  pad(o);
+  o.write(reinterpret_cast<const char*>(base), n * (2 * M + 1) * sizeof(uint32_t));
+  pad(o);
+  o.write(reinterpret_cast<const char*>(offsets), (n + 1) * sizeof(uint32_t));
+  pad(o);
+  o.write(reinterpret_cast<const char*>(upper), offsets[n] * sizeof(uint32_t));
+}
+
+// reads the graph written by store, value gives the values of the header and array the arrays that follow;
+// only the header is checked, the links are checked as the searches follow them
+template<class Value, class Array>
+void HNSW::read(Value &&value, Array &&array, const std::string &source) {
+  uint32_t magic;
+  std::memcpy(&magic, hnsw_magic, sizeof(magic));
+  if(value() != magic || value() != hnsw_version) {
+    throw std::runtime_error("not a graph file: " + source);
+  }
+  const uint32_t n = value(), order = value();
+  if(n != points->size() || order != d) {
+    throw std::runtime_error("the graph does not match the model: " + source);
+  }
+
+  M = value();
+  entry = value();
+  top = static_cast<int32_t>(value());
+  // the layers are capped at 16 when the graph is built
+  if(M < 2 || M > 1024 || top < -1 || top > 16 || (n > 0) != (top >= 0) || (n > 0 && entry >= n)) {
+    throw std::runtime_error("corrupted graph file: " + source);
+  }
+  base = array(static_cast<size_t>(n) * (2 * M + 1));
+  offsets = array(static_cast<size_t>(n) + 1);
+  upper = array(offsets[n]);
+  // the searches start from the entry, on the top layer
+  if(offsets[0] != 0 || (n > 0 && level(entry) != top)) {
+    throw std::runtime_error("corrupted graph file: " + source);
+  }
+}
+
+HNSW::HNSW(const std::shared_ptr<const KDTree> &_points, const unsigned int _d, const std::string &path) {
+  points = _points;
+  d = _d;
+  std::ifstream i(path, std::ios::binary | std::ios::ate);
+  const size_t length = i ? static_cast<size_t>(i.tellg()) : 0;
+  i.seekg(0);
+  auto buffer = std::make_shared<Buffer>();
+  std::vector<uint32_t> *arrays[] = {&buffer->base, &buffer->offsets, &buffer->upper};
+  size_t next = 0;
+  read([&i]() {
+    uint32_t v = 0;
+    i.read(reinterpret_cast<char*>(&v), sizeof(v));
+    return v;
+  }, [&](const size_t count) {
+    // the arrays start on multiples of 64 bytes, as on the binary models
+    const size_t position = (static_cast<size_t>(i.tellg()) + 63) / 64 * 64;
+    if(!i || position > length || count > (length - position) / sizeof(uint32_t)) {
+      throw std::runtime_error("truncated graph file: " + path);
+    }
+    i.seekg(position);
+    std::vector<uint32_t> &a = *arrays[next++];
+    a.resize(count);
+    i.read(reinterpret_cast<char*>(a.data()), count * sizeof(uint32_t));
+    return a.data();
+  }, path);
+  if(!i) {
+    throw std::runtime_error("truncated graph file: " + path);
+  }
+  owner = buffer;
+}
+
+HNSW::HNSW(const std::shared_ptr<const MappedFile> &file, ModelReader &reader,
+const std::shared_ptr<const KDTree> &_points, const unsigned int _d) {
+  points = _points;
+  d = _d;
+  read([&reader]() {
+    return reader.get<uint32_t>();
+  }, [&reader](const size_t count) {
+    reader.align();
+    return reader.view<uint32_t>(count);
+  }, "binary model");
+  owner = file;
+}
+
+size_t HNSW::size() const {
+  return points->size();
+}
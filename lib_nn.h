@@ -0,0 +1,585 @@
+/**
+ * @file lib_nn.h
+ * @brief Nearest Neighbours library
+ *
+ * Exact and approximate nearest neighbours search over feature vectors, used by the kNN classifier.
+ *
+ * @author $Author: Catarina Silva $
+ * @version $Revision: 1.0 $
+ * @date $Date: 2020/10/14 $
+ */
+
+#ifndef NN_H
+#define NN_H
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "lib_mf.h"
+#include "lib_oc.h"
+
+/**
+ * Minkowski metrics as policies: the term of one dimension, the reduction of the terms and the distance.
+ * The reduction of the terms (the surrogate) has the same order as the distance,
+ * so the searches rank by it and never take the root.
+ */
+namespace metric {
+  /**
+   * Manhattan distance (d = 1).
+   */
+  struct L1 {
+    explicit L1(const unsigned int) {}
+    double term(const double x) const { return std::fabs(x); }
+    double reduce(const double a, const double t) const { return a + t; }
+    double distance(const double s) const { return s; }
+  };
+
+  /**
+   * Euclidean distance (d = 2), the surrogate is the squared distance.
+   */
+  struct L2 {
+    explicit L2(const unsigned int) {}
+    double term(const double x) const { return x * x; }
+    double reduce(const double a, const double t) const { return a + t; }
+    double distance(const double s) const { return std::sqrt(s); }
+  };
+
+  /**
+   * Minkowski distance of any order p > 2, the powers are computed by multiplication.
+   */
+  struct Lp {
+    unsigned int p;
+    explicit Lp(const unsigned int _p) : p(_p) {}
+    double term(const double x) const {
+      const double t = std::fabs(x);
+      double rv = t;
+      for(unsigned int e = 1; e < p; e++) {
+        rv *= t;
+      }
+      return rv;
+    }
+    double reduce(const double a, const double t) const { return a + t; }
+    double distance(const double s) const { return std::pow(s, 1.0 / p); }
+  };
+
+  /**
+   * Chebyshev distance (d = 0).
+   */
+  struct LInf {
+    explicit LInf(const unsigned int) {}
+    double term(const double x) const { return std::fabs(x); }
+    double reduce(const double a, const double t) const { return a > t ? a : t; }
+    double distance(const double s) const { return s; }
+  };
+
+  /**
+   * Calls f with the policy of a Minkowski order, the only branch on the order.
+   *
+   * @param d the Minkowski order (0 for the Chebyshev distance)
+   * @param f the callable, receives the policy
+   * @return the result of f
+   */
+  template<class F>
+  auto dispatch(const unsigned int d, F&& f) {
+    switch(d) {
+      case 0: return f(LInf(d));
+      case 1: return f(L1(d));
+      case 2: return f(L2(d));
+      default: return f(Lp(d));
+    }
+  }
+
+  /**
+   * Surrogate of the distance between two feature vectors.
+   *
+   * @param m the metric
+   * @param a the first feature vector
+   * @param b the second feature vector
+   * @return the reduction of the terms of every dimension
+   */
+  template<class M>
+  double surrogate(const M& m, const FeatureVector &a, const FeatureVector &b) {
+    double rv = 0;
+    for(size_t i = 0; i < FeatureVector::length; i++) {
+      // the differences are computed on the precision of the features
+      rv = m.reduce(rv, m.term(a[i] - b[i]));
+    }
+    return rv;
+  }
+}
+
+/**
+ * A neighbour found by a search, ordered by distance and then by index.
+ */
+struct Neighbour {
+  double distance;
+  unsigned int index;
+
+  bool operator<(const Neighbour &other) const {
+    return distance < other.distance || (distance == other.distance && index < other.index);
+  }
+};
+
+/**
+ * Scores n rows of a column store against a query, one vectorized sweep per column (see InstanceStore::score).
+ * There is one overload per metric, each compiled for AVX-512, AVX2 and the baseline instruction set.
+ *
+ * @param m the metric
+ * @param columns the first row of the first column
+ * @param stride distance (in values) between two columns
+ * @param n the number of rows
+ * @param query the query, without the bias
+ * @param out the surrogate of each row
+ */
+void score_columns(const metric::L1&, const feature_t*, const size_t, const size_t, const feature_t*, double*);
+void score_columns(const metric::L2&, const feature_t*, const size_t, const size_t, const feature_t*, double*);
+void score_columns(const metric::Lp&, const feature_t*, const size_t, const size_t, const feature_t*, double*);
+void score_columns(const metric::LInf&, const feature_t*, const size_t, const size_t, const feature_t*, double*);
+
+/**
+ * Scores at most 256 rows of a column store against a query, abandoning the rows above a bound
+ * (see InstanceStore::score_bounded). There is one overload per metric, compiled as score_columns.
+ *
+ * @param m the metric
+ * @param columns the first row of the first column
+ * @param stride distance (in values) between two columns
+ * @param n the number of rows
+ * @param query the query, without the bias
+ * @param dims the order of the dimensions
+ * @param bound the largest surrogate of interest
+ * @param out the surrogate of each row, any value above the bound for the abandoned ones
+ */
+void score_bounded_columns(const metric::L1&, const feature_t*, const size_t, const size_t, const feature_t*,
+  const unsigned int*, const double, double*);
+void score_bounded_columns(const metric::L2&, const feature_t*, const size_t, const size_t, const feature_t*,
+  const unsigned int*, const double, double*);
+void score_bounded_columns(const metric::Lp&, const feature_t*, const size_t, const size_t, const feature_t*,
+  const unsigned int*, const double, double*);
+void score_bounded_columns(const metric::LInf&, const feature_t*, const size_t, const size_t, const feature_t*,
+  const unsigned int*, const double, double*);
+
+/**
+ * Feature vectors stored by columns: the values of each dimension are contiguous, so a query is scored against
+ * a range of instances with one vectorized sweep per dimension.
+ * The bias (always 1) is not stored.
+ */
+class InstanceStore {
+  private:
+    // number of instances and distance (in values) between two columns
+    size_t rows, stride;
+    // the values are shared by the copies of the store, and owned by a buffer of the store or a mapped model file
+    std::shared_ptr<const void> owner;
+    const feature_t *columns;
+    // squared Euclidean norm of each instance
+    const double *norms;
+    // the dimensions by descending variance over the instances
+    std::array<unsigned int, FeatureVector::length - 1> by_variance;
+
+  public:
+    static constexpr size_t dimensions = FeatureVector::length - 1;
+    // number of queries of each call to dot
+    static constexpr size_t dot_queries = 4;
+    // number of dimensions scored on every instance by score_bounded
+    static constexpr size_t head = 4;
+
+    InstanceStore();
+    InstanceStore(const std::vector<FeatureVector>&);
+
+    /**
+     * Reads the instances written by store. The values are used in place on the mapping
+     * when they were stored with the precision of feature_t, and converted otherwise.
+     *
+     * @param file the mapped model, kept alive by the store
+     * @param reader the reader, at the start of the instances
+     * @param rows the number of instances
+     * @param feature_bytes the size of each stored value
+     */
+    InstanceStore(const std::shared_ptr<const MappedFile>&, ModelReader&, const size_t, const size_t);
+
+    /**
+     * Writes the instances to a binary model: the dimensions by variance, the columns and the norms,
+     * each starting on a multiple of 64 bytes.
+     *
+     * @param o the payload
+     */
+    void store(std::ostream&) const;
+
+    /**
+     * Computes the surrogate of the distance between a query and the instances [begin, end).
+     * Dispatched at runtime to an AVX-512, AVX2 or scalar version.
+     *
+     * @param m the metric
+     * @param query the feature vector
+     * @param begin the first instance
+     * @param end one past the last instance
+     * @param out the score of each instance (end - begin values)
+     */
+    template<class M>
+    void score(const M& m, const FeatureVector &query, const size_t begin, const size_t end, double *out) const {
+      score_columns(m, columns + begin, stride, end - begin, query.values + 1, out);
+    }
+
+    /**
+     * Computes the surrogate as score does, but abandons each instance as soon as its partial surrogate exceeds
+     * a bound (partial distance search). The dimensions are visited by descending variance over the instances,
+     * so the bound is crossed as early as possible: the first head dimensions are scored on every instance,
+     * then each further dimension only on the instances still below the bound.
+     *
+     * @param m the metric
+     * @param query the feature vector
+     * @param begin the first instance
+     * @param end one past the last instance (at most 256 instances)
+     * @param bound the largest surrogate of interest (e.g. the one of the k-th nearest neighbour found)
+     * @param out the score of each instance (end - begin values), any value above the bound for the abandoned ones
+     */
+    template<class M>
+    void score_bounded(const M& m, const FeatureVector &query, const size_t begin, const size_t end,
+    const double bound, double *out) const {
+      score_bounded_columns(m, columns + begin, stride, end - begin, query.values + 1, by_variance.data(),
+        bound, out);
+    }
+
+    /**
+     * Computes the dot products between dot_queries queries and the instances [begin, end),
+     * loading each value of the instances once for all the queries.
+     *
+     * @param queries the feature vectors (repeat one to compute fewer)
+     * @param begin the first instance
+     * @param end one past the last instance
+     * @param out the products of each query, one after the other (end - begin values each)
+     */
+    void dot(const FeatureVector *const *, const size_t, const size_t, double*) const;
+
+    /**
+     * @param i the index of an instance
+     * @return the squared Euclidean norm of the instance (without the bias)
+     */
+    double norm(const size_t) const;
+
+    /**
+     * @param i the index of an instance
+     * @return the feature vector of the instance
+     */
+    FeatureVector point(const size_t) const;
+
+    size_t size() const;
+};
+
+/**
+ * @return the instruction set used by InstanceStore::score on this CPU ("avx512f", "avx2" or "scalar")
+ */
+const char* simd_kernel();
+
+/**
+ * Feature vectors quantized to 8 bits per dimension, stored by columns (as InstanceStore).
+ * Each dimension maps its range of values [offset, offset + 255 * scale] to the codes 0..255,
+ * so an instance takes 12 bytes instead of 12 features.
+ * The searches score the codes directly, the differences are only scaled back to the units of the features.
+ */
+class QuantizedStore {
+  public:
+    static constexpr size_t dimensions = InstanceStore::dimensions;
+    using Parameters = std::array<double, dimensions>;
+
+  private:
+    size_t rows, stride;
+    // the codes are shared by the copies of the store, and owned by a buffer of the store or a mapped model file
+    std::shared_ptr<const void> owner;
+    const uint8_t *columns;
+    Parameters scale, offset;
+    unsigned int d;
+
+  public:
+    /**
+     * Quantizes the feature vectors, with the range of values of each dimension.
+     *
+     * @param points the feature vectors, the results of the searches refer to their index on this vector
+     * @param d the Minkowski order (0 for the Chebyshev distance)
+     */
+    QuantizedStore(const std::vector<FeatureVector>&, const unsigned int);
+
+    /**
+     * Quantizes the feature vectors with the given parameters (e.g. the ones of a stored model);
+     * the values out of range are clamped.
+     *
+     * @param points the feature vectors, the results of the searches refer to their index on this vector
+     * @param d the Minkowski order (0 for the Chebyshev distance)
+     * @param scale the difference between two consecutive codes, per dimension
+     * @param offset the value of the code 0, per dimension
+     */
+    QuantizedStore(const std::vector<FeatureVector>&, const unsigned int, const Parameters&, const Parameters&);
+
+    /**
+     * Reads the codes written by store, they are used in place on the mapping.
+     *
+     * @param file the mapped model, kept alive by the store
+     * @param reader the reader, at the start of the codes
+     * @param rows the number of points
+     * @param d the Minkowski order (0 for the Chebyshev distance)
+     */
+    QuantizedStore(const std::shared_ptr<const MappedFile>&, ModelReader&, const size_t, const unsigned int);
+
+    /**
+     * Writes the codes to a binary model: the scale and offset of each dimension (double), then the columns
+     * starting on a multiple of 64 bytes.
+     *
+     * @param o the payload
+     */
+    void store(std::ostream&) const;
+
+    /**
+     * Finds the k nearest neighbours of a query on the quantized feature vectors
+     * (the ties are broken by the index of the points).
+     *
+     * @param query the feature vector to search
+     * @param k the number of neighbours
+     * @return the neighbours, sorted from the nearest, with the surrogate of the distance (see KDTree::search)
+     */
+    std::vector<Neighbour> search(const FeatureVector&, const size_t) const;
+
+    /**
+     * @param i the index of a point
+     * @return the codes of the point, one per dimension (the bias is not stored)
+     */
+    std::array<uint8_t, dimensions> codes(const size_t) const;
+
+    /**
+     * @param i the index of a point
+     * @return the feature vector represented by the codes of the point
+     */
+    FeatureVector dequantize(const size_t) const;
+
+    const Parameters& get_scale() const;
+    const Parameters& get_offset() const;
+    size_t size() const;
+};
+
+/**
+ * KD-tree over feature vectors, for exact k nearest neighbours search with any Minkowski order.
+ * Each node splits its points at the median of the dimension with the largest spread,
+ * and the points of the leaves are stored contiguously in the order of the tree.
+ * The metric is chosen when the tree is built, the searches run a version of the code specialized for it.
+ */
+class KDTree {
+  private:
+    // 32 bytes, as stored on the binary models
+    struct Node {
+      // range of the points of the node (on the order of the tree)
+      uint32_t begin, end;
+      // split dimension (-1 on the leaves) and value, the points below the split are on the left child
+      int32_t axis, left, right, unused;
+      double split;
+    };
+    // the arrays of a tree built in memory
+    struct Buffer;
+
+    // the points on the order of the tree
+    InstanceStore points;
+    // the arrays are shared by the copies of the tree, and owned by a buffer or a mapped model file:
+    // the index (on the input of the constructor) of each point, the position of each input on the tree and the nodes
+    std::shared_ptr<const void> owner;
+    const uint32_t *order, *position;
+    const Node *nodes;
+    size_t node_count, max_leaf;
+    // number of points scored at once, the bound of the partial distance search is updated between blocks
+    static constexpr size_t block = 256;
+    // Minkowski order and the search specialized for it
+    unsigned int d;
+    std::vector<Neighbour> (KDTree::*searcher)(const FeatureVector&, const size_t, size_t&) const;
+    // number of queries of a batch searched on the tree to decide between the tree and the scan,
+    // and the cost of a point scored by a search of the tree in points scored by the scan (measured 3 to 5)
+    static constexpr size_t probe = 16;
+    static constexpr double scan_ratio = 4.0;
+
+    int build(const std::vector<FeatureVector>&, Buffer&, const unsigned int, const unsigned int, const unsigned int);
+    template<class M>
+    std::vector<Neighbour> find(const FeatureVector&, const size_t, size_t&) const;
+    template<class M>
+    void descend(const M&, const int, const FeatureVector&, const size_t, std::vector<Neighbour>&,
+      std::vector<double>&, size_t&) const;
+    template<class M>
+    void scan(const M&, const std::vector<FeatureVector>&, const size_t, const size_t, const size_t,
+      std::vector<std::vector<Neighbour>>&) const;
+    template<class M>
+    void rescore(const M&, const FeatureVector&, std::vector<Neighbour>&) const;
+    void scan(const metric::L2&, const std::vector<FeatureVector>&, const size_t, const size_t, const size_t,
+      std::vector<std::vector<Neighbour>>&) const;
+
+  public:
+    /**
+     * Builds the tree.
+     *
+     * @param points the feature vectors, the results of the searches refer to their index on this vector
+     * @param d the Minkowski order (0 for the Chebyshev distance)
+     * @param leaf_size maximum number of points on a leaf (the number of points makes an exhaustive search)
+     */
+    KDTree(const std::vector<FeatureVector>&, const unsigned int, const unsigned int leaf_size=16);
+
+    /**
+     * Reads a tree written by store, its arrays and points stay on the mapping (see InstanceStore).
+     * The indices and the nodes are checked once, so the searches can trust them.
+     *
+     * @param file the mapped model, kept alive by the tree
+     * @param reader the reader, at the start of the tree
+     * @param d the Minkowski order (0 for the Chebyshev distance)
+     */
+    KDTree(const std::shared_ptr<const MappedFile>&, ModelReader&, const unsigned int);
+
+    /**
+     * Writes the tree to a binary model: its size, the order and the position of the points, the nodes
+     * and the points, the arrays starting on multiples of 64 bytes.
+     *
+     * @param o the payload
+     */
+    void store(std::ostream&) const;
+
+    /**
+     * Finds the k nearest neighbours of a query, as an exhaustive search would
+     * (the ties are broken by the index of the points).
+     *
+     * @param query the feature vector to search
+     * @param k the number of neighbours
+     * @return the neighbours, sorted from the nearest, with the surrogate of the distance (see distance)
+     */
+    std::vector<Neighbour> search(const FeatureVector&, const size_t) const;
+
+    /**
+     * Finds the k nearest neighbours of many queries at once (e.g. every cell of a slide).
+     * The first queries are searched on the tree; if its searches scored too many points to beat a scan,
+     * the other queries are found with an exhaustive scan, which pays off when the tree prunes little.
+     * The queries are split in tiles over the workers, and on the scan each tile sweeps the points by blocks
+     * that stay in cache while every query of the tile is scored.
+     * The Euclidean distance is computed as |q|^2 + |p|^2 - 2 q.p, from the norms of the points;
+     * the distances of the neighbours found are then computed again as search does, so the results only differ
+     * from search on distances tied up to rounding.
+     *
+     * @param queries the feature vectors to search
+     * @param k the number of neighbours
+     * @param workers number of threads used
+     * @return the neighbours of each query, as returned by search
+     */
+    std::vector<std::vector<Neighbour>> search_batch(const std::vector<FeatureVector>&, const size_t,
+      const unsigned int workers=1) const;
+
+    /**
+     * @param surrogate the distance of a neighbour returned by search
+     * @return the Minkowski distance
+     */
+    double distance(const double) const;
+
+    /**
+     * @param i the index of a point (on the input of the constructor)
+     * @return the feature vector of the point
+     */
+    FeatureVector point(const size_t) const;
+
+    size_t size() const;
+};
+
+/**
+ * Hierarchical navigable small world graph (HNSW) over the points of a KD-tree, for approximate k nearest neighbours search.
+ * Each point is linked to its nearest points on a random number of layers, sparser towards the top;
+ * a search descends greedily from the top layer and explores the bottom layer with a beam of ef candidates.
+ * Larger values of M and ef raise the recall at the cost of speed (and memory, for M).
+ */
+class HNSW {
+  private:
+    // the links of a graph built in memory or read from a graph file
+    struct Buffer;
+
+    // the points are the ones of the tree (shared, never copied)
+    std::shared_ptr<const KDTree> points;
+    // Minkowski order and maximum number of links of a node on the upper layers (2M on the bottom layer)
+    unsigned int d, M;
+    // the links are shared by the copies of the graph, and owned by a buffer or a mapped model file:
+    // 2M + 1 slots per node on the bottom layer (the number of links followed by the links), and M + 1 slots
+    // per upper layer of each node, from upper[offsets[node]] to upper[offsets[node + 1]]
+    std::shared_ptr<const void> owner;
+    const uint32_t *base, *offsets, *upper;
+    unsigned int entry;
+    int top;
+
+    int level(const unsigned int) const;
+    const uint32_t* links(const unsigned int, const int) const;
+    uint32_t* links(Buffer&, const unsigned int, const int) const;
+    void use(const std::shared_ptr<Buffer>&);
+    template<class Metric>
+    void insert(const Metric&, Buffer&, const unsigned int, const int, const unsigned int);
+    template<class Metric>
+    std::vector<Neighbour> search_layer(const Metric&, const FeatureVector&, const std::vector<Neighbour>&,
+      const size_t, const int) const;
+    template<class Metric>
+    std::vector<Neighbour> select(const Metric&, const std::vector<Neighbour>&, const size_t) const;
+    template<class Metric>
+    std::vector<Neighbour> find(const Metric&, const FeatureVector&, const size_t, const size_t) const;
+    template<class Value, class Array>
+    void read(Value&&, Array&&, const std::string&);
+
+  public:
+    /**
+     * Builds the graph, inserting the points in order (the layers are drawn from a fixed seed).
+     *
+     * @param points the tree whose points are linked, the results of the searches refer to their index
+     * @param d the Minkowski order (0 for the Chebyshev distance)
+     * @param M the number of links per node
+     * @param ef_construction the size of the beam used to find the links of each point
+     */
+    HNSW(const std::shared_ptr<const KDTree>&, const unsigned int, const unsigned int M=16,
+      const unsigned int ef_construction=100);
+
+    /**
+     * Loads a graph written by store.
+     * Throws std::runtime_error if the file is not a graph over the same number of points and Minkowski order.
+     *
+     * @param points the tree the graph was built on
+     * @param d the Minkowski order (0 for the Chebyshev distance)
+     * @param path the graph file
+     */
+    HNSW(const std::shared_ptr<const KDTree>&, const unsigned int, const std::string&);
+
+    /**
+     * Reads a graph stored on a binary model, as written by store; the links are used in place on the mapping.
+     * The links are checked as the searches follow them, so the graph is not read when loaded.
+     *
+     * @param file the mapped model, kept alive by the graph
+     * @param reader the reader, at the start of the graph
+     * @param points the tree the graph was built on
+     * @param d the Minkowski order (0 for the Chebyshev distance)
+     */
+    HNSW(const std::shared_ptr<const MappedFile>&, ModelReader&, const std::shared_ptr<const KDTree>&,
+      const unsigned int);
+
+    /**
+     * Finds (approximately) the k nearest neighbours of a query.
+     *
+     * @param query the feature vector to search
+     * @param k the number of neighbours
+     * @param ef the size of the beam on the bottom layer (at least k)
+     * @return the neighbours, sorted from the nearest, with the surrogate of the distance (see KDTree::search)
+     */
+    std::vector<Neighbour> search(const FeatureVector&, const size_t, const size_t) const;
+
+    /**
+     * Writes the graph (not the points) to a binary file.
+     *
+     * @param path the graph file
+     */
+    void store(const std::string&) const;
+
+    /**
+     * Writes the graph to a binary model: the number of points, d, M, the entry and the top layer,
+     * then the bottom links, the offsets and the upper links, each starting on a multiple of 64 bytes.
+     *
+     * @param o the payload (or a graph file)
+     */
+    void store(std::ostream&) const;
+
+    size_t size() const;
+};
+
+#endif
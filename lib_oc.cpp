@@ -1,8 +1,17 @@
 #include "lib_oc.h"
+#include "lib_fs.h"
+#include "lib_mf.h"
+#include "lib_nn.h"
+#include "lib_pf.h"
+#include "lib_mt.h"
 
 #include <algorithm>
 #include <fstream>
+#include <iostream>
+#include <numeric>
 #include <random>
+#include <sstream>
+#include <stdexcept>
 #include <cmath>
 
 #define _USE_MATH_DEFINES
@@ -23,106 +32,81 @@ double sigmoid(const double x) {
 
 Features::Features(const std::array<double, 8> &_hist, const double _circularity,
 const double _roundness, const double _aspect_ratio, const double _solidity) {
-  hist = _hist;
-  circularity = _circularity;
-  roundness = _roundness;
-  aspect_ratio = _aspect_ratio;
-  solidity = _solidity;
+  std::fill(std::begin(values.values), std::end(values.values), 0);
+  values[0] = 1.0;
+  for(size_t i = 0; i < _hist.size(); i++) {
+    values[i + 1] = _hist[i];
+  }
+  values[9] = _circularity;
+  values[10] = _roundness;
+  values[11] = _aspect_ratio;
+  values[12] = _solidity;
 }
 
-Features::Features(const std::vector<cv::Point>& contour) {
-  std::vector<unsigned char> chaincode = chain(contour);
-  std::fill(std::begin(hist), std::end(hist), 0);
+Features::Features(const ContourView& contour) : Features(contour, contour_shape(contour)) {
+}
 
-  for (auto vec : chaincode) {
-    hist[vec]++;
+Features::Features(const ContourView& contour, const ContourShape& shape) {
+  StageTimer timer(Stage::features);
+  // histogram of the chain code
+  const ChainCode code = chain_code(contour);
+  std::array<double, 8> hist;
+  for(size_t i = 0; i < hist.size(); i++) {
+    hist[i] = code.length > 0 ? static_cast<double>(code.histogram[i]) / code.length : 0.0;
   }
 
-  if(chaincode.size() > 0) {
-    for(size_t i = 0; i < hist.size(); i++) {
-      hist[i] /= chaincode.size();
-    }
-  }
+  // the area, perimeter and the axes of the ellipse with the same moments come with the shape
+  const double hull_area = contour_shape(convex_hull(contour)).area;
 
-  std::vector<cv::Point> hull;
-  cv::convexHull(contour, hull);
-  auto rbb = cv::fitEllipse(contour);
-  double area = cv::contourArea(contour),
-  perimeter = cv::arcLength(contour, true),
-  major_axis = std::max(rbb.size.width, rbb.size.height),
-  minor_axis = std::min(rbb.size.width, rbb.size.height);
-  
-  circularity = (4.0*M_PI*area)/pow(perimeter, 2);
-  roundness = (4.0*area)/(M_PI*pow(major_axis,2));
-  aspect_ratio = major_axis / minor_axis;
-  solidity = area / cv::contourArea(hull);
+  // the descriptors of degenerate contours (without area) are 0
+  *this = Features(hist,
+    shape.perimeter > 0 ? (4.0*M_PI*shape.area)/pow(shape.perimeter, 2) : 0.0,
+    shape.major_axis > 0 ? (4.0*shape.area)/(M_PI*pow(shape.major_axis,2)) : 0.0,
+    shape.minor_axis > 0 ? shape.major_axis / shape.minor_axis : 0.0,
+    hull_area > 0 ? shape.area / hull_area : 0.0);
 }
 
 double Features::distance(const Features& other, const unsigned int d) const {
-  auto array0 = get_features(), array1 = other.get_features();
-  
-  double distance = 0;
-  
-  //Chebyshev distance
-  if(d == 0) {
-    double max = 0;
-    for(size_t i = 0; i < array0.size(); i++) {
-      double t = fabs(array0[i] - array1[i]);
-      if(t < max) {
-        max = t;
-      }
-    }
-    distance = max;
-  } else {
-    double sum = 0.0;
-    for(size_t i = 0; i < array0.size(); i++) {
-      sum += pow(array0[i] - array1[i], d);
-    }
-    distance = pow(sum, 1.0/d);
-  }
-
-  return distance;
+  return metric::dispatch(d, [&](auto m) {
+    return m.distance(metric::surrogate(m, get_features(), other.get_features()));
+  });
 }
 
-std::vector<double> Features::get_features() const {
-  std::vector<double> res;
-  res.push_back(1.0);
-  for(auto h: hist) {
-    res.push_back(h);
-  }
-  res.push_back(circularity);
-  res.push_back(roundness);
-  res.push_back(aspect_ratio);
-  res.push_back(solidity); 
-  return res;
+const FeatureVector& Features::get_features() const {
+  return values;
 }
 
 std::array<double, 8> Features::get_histogram() const {
+  std::array<double, 8> hist;
+  for(size_t i = 0; i < hist.size(); i++) {
+    hist[i] = values[i + 1];
+  }
   return hist;
 }
 
 double Features::get_circularity() const {
-  return circularity;
+  return values[9];
 }
 
 double Features::get_roundness() const {
-  return roundness;
+  return values[10];
 }
 
 double Features::get_aspect_ratio() const {
-  return aspect_ratio;
+  return values[11];
 }
 
 double Features::get_solidity() const {
-  return solidity;
+  return values[12];
 }
 
 std::ostream& operator<<(std::ostream &strm, const Features &o) {
-  strm << "{'circularity':"<<o.circularity<<",'roundness':"<<o.roundness<<
-  ",'aspect_ratio':"<<o.aspect_ratio<<",'solidity':"<<o.solidity<<",'h':[";
-  for(size_t i = 0; i < o.hist.size(); ++i) {
-    strm << std::fixed << std:: setprecision(2) << o.hist[i];
-    if (i != o.hist.size() - 1) {
+  const auto hist = o.get_histogram();
+  strm << "{'circularity':"<<o.get_circularity()<<",'roundness':"<<o.get_roundness()<<
+  ",'aspect_ratio':"<<o.get_aspect_ratio()<<",'solidity':"<<o.get_solidity()<<",'h':[";
+  for(size_t i = 0; i < hist.size(); ++i) {
+    strm << std::fixed << std:: setprecision(2) << hist[i];
+    if (i != hist.size() - 1) {
       strm << ", ";
     }
   }
@@ -130,135 +114,613 @@ std::ostream& operator<<(std::ostream &strm, const Features &o) {
   return strm;
 }
 
-ML& ML::load(const std::string& path) {
+void to_json(json& j, const Features& f) {
+  j["circularity"] = f.get_circularity();
+  j["roundness"] = f.get_roundness();
+  j["aspect_ratio"] = f.get_aspect_ratio();
+  j["solidity"] = f.get_solidity();
+  json histogram;
+  for(auto h: f.get_histogram()) {
+    histogram.push_back(h);
+  }
+  j["histogram"] = histogram;
+}
+
+Features features_from_json(const json& j) {
+  std::array<double, 8> hist;
+  for(size_t k = 0; k < hist.size(); k++) {
+    hist[k] = j["histogram"][k];
+  }
+  return Features(hist, j["circularity"], j["roundness"], j["aspect_ratio"], j["solidity"]);
+}
+
+const Features& Object::get_features() const {
+  if(!features) {
+    features = std::make_shared<const Features>(contour, shape);
+  }
+  return *features;
+}
+
+std::string ML::predict(const Object &object) const {
+  return get_labels()[predict(object.get_features())];
+}
+
+std::vector<int> ML::predict_batch(const std::vector<Features> &features, const unsigned int workers) const {
+  std::vector<int> rv(features.size());
+  if(workers <= 1) {
+    for(size_t i = 0; i < features.size(); i++) {
+      rv[i] = predict(features[i]);
+    }
+    return rv;
+  }
+
+  // the batch is timed on the calling thread, which aggregates the image, and the objects are not timed by the workers
+  StageTimer timer(Stage::predict_batch);
+  parallel_for(features.size(), workers, [&](const size_t i, const unsigned int) {
+    SuspendTimers suspend;
+    rv[i] = predict(features[i]);
+  });
+  return rv;
+}
+
+/**
+ * Keeps the pipeline version stored on a model, warning when its features were computed by another version.
+ *
+ * @param model the model loaded
+ * @param path the model file
+ * @param version the pipeline version stored on the model, 0 if none
+ * @return the model
+ */
+std::unique_ptr<ML> ML::stamp(std::unique_ptr<ML> model, const std::string &path, const unsigned int version) {
+  if(version != pipeline_version) {
+    std::cerr<<"warning: "<<path<<" was trained on the features of pipeline version "<<version<<" (current "
+      <<pipeline_version<<"), retrain it with train"<<std::endl;
+  }
+  model->pipeline = version;
+  return model;
+}
+
+std::unique_ptr<ML> ML::load(const std::string& path) {
+  if(is_binary_model(path)) {
+    auto file = std::make_shared<const MappedFile>(path);
+    switch(file->header().model) {
+      case ModelType::knn:
+        return stamp(KNN::load_binary(file), path, file->header().pipeline);
+      case ModelType::lr:
+        return stamp(LR::load_binary(*file), path, file->header().pipeline);
+      default:
+        throw std::runtime_error("unknown model type: " + path);
+    }
+  }
+
   std::ifstream i(path);
+  if(!i) {
+    throw std::runtime_error("cannot open the model file: " + path);
+  }
   json j;
   i >> j;
 
   std::string model = j["model"];
+  const unsigned int version = j.value("pipeline", 0u);
 
   if(model.compare("lr") == 0) {
-    return LR::load(j);
+    return stamp(LR::load(j), path, version);
   } else {
-    return KNN::load(j);
+    return stamp(KNN::load(j, path), path, version);
   }
 }
 
 KNN::KNN(const unsigned int _k, const unsigned int _d) {
   k = _k;
   d = _d;
+  ef = 0;
+  rerank = 0;
+  classes = nullptr;
 }
 
 KNN::KNN(const unsigned int _k, const unsigned int _d,
 const std::vector<std::pair<std::string, Features>> &_instances){
   k = _k;
   d = _d;
+  ef = 0;
+  rerank = 0;
+  classes = nullptr;
   instances = _instances;
+  index();
 }
 
 void KNN::learn(const std::vector<std::pair<std::string, Features>> &inst) {
+  materialize();
   for(auto i: inst) {
     instances.push_back(i);
   }
+  index();
+}
+
+// the points of the indexes, the instances sorted by class ID
+std::vector<FeatureVector> index_points(const std::vector<std::pair<std::string, Features>> &instances,
+const std::vector<unsigned int> &by_class) {
+  std::vector<FeatureVector> points;
+  points.reserve(instances.size());
+  for(auto i: by_class) {
+    points.push_back(instances[i].second.get_features());
+  }
+  return points;
+}
+
+// the features of a point of the indexes
+Features point_features(const FeatureVector &p) {
+  std::array<double, 8> hist;
+  std::copy(p.begin() + 1, p.begin() + 9, hist.begin());
+  return Features(hist, p[9], p[10], p[11], p[12]);
+}
+
+void KNN::label() {
+  labels.clear();
+  for(auto& i: instances) {
+    labels.push_back(i.first);
+  }
+  std::sort(labels.begin(), labels.end());
+  labels.erase(std::unique(labels.begin(), labels.end()), labels.end());
+
+  // the IDs follow the order of the labels, so ties are broken as when sorting by label
+  ids.clear();
+  for(auto& i: instances) {
+    ids.push_back(std::lower_bound(labels.begin(), labels.end(), i.first) - labels.begin());
+  }
+
+  // the tree breaks ties by index, so its points are sorted by class ID to break them by class
+  by_class.resize(instances.size());
+  std::iota(by_class.begin(), by_class.end(), 0);
+  std::stable_sort(by_class.begin(), by_class.end(), [&](const unsigned int a, const unsigned int b) {
+    return ids[a] < ids[b];
+  });
+  auto sorted = std::make_shared<std::vector<uint32_t>>();
+  sorted->reserve(by_class.size());
+  for(auto i: by_class) {
+    sorted->push_back(ids[i]);
+  }
+  classes = sorted->data();
+  owner = sorted;
+}
+
+void KNN::index() {
+  label();
+  const auto points = index_points(instances, by_class);
+  // the metric is fixed for the model, the tree specializes its searches for it
+  tree = std::make_shared<const KDTree>(points, d);
+  // a graph or codes over other instances would return wrong neighbours
+  graph.reset();
+  quantized.reset();
+  exact.reset();
+}
+
+FeatureVector KNN::point(const size_t i) const {
+  if(tree) {
+    return tree->point(i);
+  }
+  return exact ? exact->point(i) : quantized->dequantize(i);
+}
+
+std::vector<std::pair<std::string, Features>> KNN::all_instances() const {
+  if(!instances.empty() || (!tree && !quantized)) {
+    return instances;
+  }
+  std::vector<std::pair<std::string, Features>> rv;
+  rv.reserve(size());
+  for(size_t i = 0; i < size(); i++) {
+    rv.push_back(std::pair(labels[classes[i]], point_features(point(i))));
+  }
+  return rv;
+}
+
+void KNN::materialize() {
+  if(instances.empty() && size() > 0) {
+    // the instances are read back on the order of the points (sorted by class), which label keeps
+    instances = all_instances();
+    label();
+  }
+  if(!tree) {
+    // a quantized model: the instances get a tree again, and lose their codes
+    index();
+  }
+}
+
+void KNN::keep_codes(const std::vector<FeatureVector> &points, const std::shared_ptr<const QuantizedStore> &codes,
+const bool features) {
+  quantized = codes;
+  exact = features ? std::make_shared<const InstanceStore>(points) : nullptr;
+  // the codes replace every other copy of the points
+  tree.reset();
+  graph.reset();
+  instances.clear();
+  instances.shrink_to_fit();
+}
+
+void KNN::build_graph(const unsigned int M) {
+  materialize();
+  graph = std::make_shared<const HNSW>(tree, d, M);
+}
+
+void KNN::quantize(const unsigned int _rerank) {
+  materialize();
+  rerank = _rerank;
+  const auto points = index_points(instances, by_class);
+  keep_codes(points, std::make_shared<const QuantizedStore>(points, d), rerank > 0);
+}
+
+bool KNN::set_rerank(const unsigned int _rerank) {
+  if(!quantized || (_rerank > 0 && !exact)) {
+    return false;
+  }
+  rerank = _rerank;
+  return true;
+}
+
+bool KNN::approximate(const unsigned int _ef) {
+  // the quantized models always scan their codes, the graph would never be searched
+  if(quantized) {
+    return false;
+  }
+  if(_ef > 0 && !graph) {
+    build_graph(16);
+  }
+  ef = _ef;
+  return true;
+}
+
+const std::vector<std::string>& KNN::get_labels() const {
+  return labels;
 }
 
 std::ostream& operator<<(std::ostream &strm, const KNN &o) {
+  const auto instances = o.all_instances();
   strm << "KNN: {'k':"<<o.k<<", 'd':"<<o.d<<", instances:['"<<std::endl;
-  for(size_t i = 0; i < o.instances.size() - 1; i++) {
-    strm << "{'label':"<<o.instances[i].first<<",'features':"<<o.instances[i].second<<"},"<<std::endl;
+  for(size_t i = 0; i < instances.size() - 1; i++) {
+    strm << "{'label':"<<instances[i].first<<",'features':"<<instances[i].second<<"},"<<std::endl;
   }
-  strm << "{'label':"<<o.instances[o.instances.size() - 1].first<<",'features':"<<o.instances[o.instances.size() - 1].second<<"}"<<std::endl;
+  strm << "{'label':"<<instances[instances.size() - 1].first<<",'features':"<<instances[instances.size() - 1].second<<"}"<<std::endl;
   strm << "]}";
   return strm;
 }
 
-std::string most_frequent(const std::vector<std::string> &votes) { 
-  // Insert all elements in hash. 
-  std::unordered_map<std::string, unsigned int> hash; 
+int most_frequent(const std::vector<int> &votes, const size_t classes) {
+  std::vector<unsigned int> count(classes, 0);
   for (size_t i = 0; i < votes.size(); i++) {
-    hash[votes[i]]++;
+    count[votes[i]]++;
   }
 
-  // find the max frequency 
-  unsigned int max_count = 0; 
-  std::string rv = votes[0]; 
-  for (auto i : hash) { 
-    if (max_count < i.second) { 
-      rv = i.first; 
-      max_count = i.second; 
-    } 
-  } 
+  // find the max frequency, ties go to the class with the nearest vote
+  unsigned int max_count = 0;
+  int rv = votes[0];
+  for (auto v : votes) {
+    if (max_count < count[v]) {
+      rv = v;
+      max_count = count[v];
+    }
+  }
+
+  return rv;
+}
+
+int KNN::predict(const Features &feature) const {
+  StageTimer timer(Stage::predict);
+  std::vector<int> votes;
+  std::vector<Neighbour> neighbours;
+  if(quantized) {
+    neighbours = quantized->search(feature.get_features(), rerank > 0 ? rerank * k : k);
+    if(rerank > 0) {
+      metric::dispatch(d, [&](auto m) {
+        for(auto& n: neighbours) {
+          n.distance = metric::surrogate(m, feature.get_features(), exact->point(n.index));
+        }
+        return 0;
+      });
+      std::sort(neighbours.begin(), neighbours.end());
+      neighbours.resize(std::min<size_t>(neighbours.size(), k));
+    }
+  } else if(graph && ef > 0) {
+    neighbours = graph->search(feature.get_features(), k, ef);
+  } else {
+    neighbours = tree->search(feature.get_features(), k);
+  }
+  for(auto& n: neighbours) {
+    votes.push_back(classes[n.index]);
+  }
 
-  return rv; 
+  return most_frequent(votes, labels.size());
 }
 
-std::string KNN::predict(const Object &object) const {
-  std::vector<std::string> votes;
-  std::vector<std::pair<double, std::string>> distances;
+void KNN::condense() {
+  materialize();
+  if(instances.empty()) {
+    return;
+  }
 
-  auto feature = Features(object.get_contour());
+  // Wilson editing: the vote of the nearest neighbours of each instance, without the instance itself
+  const size_t votes = std::max(k, 3u);
+  std::vector<bool> kept(instances.size(), false);
+  for(unsigned int i = 0; i < by_class.size(); i++) {
+    std::vector<int> v;
+    for(auto& n: tree->search(instances[by_class[i]].second.get_features(), votes + 1)) {
+      if(n.index != i && v.size() < votes) {
+        v.push_back(classes[n.index]);
+      }
+    }
+    kept[by_class[i]] = v.empty() || most_frequent(v, labels.size()) == static_cast<int>(classes[i]);
+  }
+  std::vector<unsigned int> edited;
+  for(unsigned int i = 0; i < instances.size(); i++) {
+    if(kept[i]) {
+      edited.push_back(i);
+    }
+  }
+
+  // Hart's rule: starts with the first instance of each class and adds every instance misclassified
+  // by its nearest neighbour on the subset, until a pass adds none
+  std::vector<unsigned int> subset;
+  std::vector<bool> in_subset(instances.size(), false), seen(labels.size(), false);
+  for(auto i: edited) {
+    if(!seen[ids[i]]) {
+      seen[ids[i]] = true;
+      in_subset[i] = true;
+      subset.push_back(i);
+    }
+  }
+  bool changed = true;
+  while(changed) {
+    changed = false;
+    for(auto i: edited) {
+      if(in_subset[i]) {
+        continue;
+      }
+      unsigned int nearest = subset[0];
+      double best = instances[i].second.distance(instances[nearest].second, d);
+      for(auto s: subset) {
+        const double distance = instances[i].second.distance(instances[s].second, d);
+        if(distance < best) {
+          best = distance;
+          nearest = s;
+        }
+      }
+      if(ids[nearest] != ids[i]) {
+        in_subset[i] = true;
+        subset.push_back(i);
+        changed = true;
+      }
+    }
+  }
 
-  for(unsigned int i = 0; i < instances.size(); i++){
-    distances.push_back(std::pair(feature.distance(instances[i].second, d), instances[i].first));
+  // the instances keep their order
+  std::sort(subset.begin(), subset.end());
+  std::vector<std::pair<std::string, Features>> condensed;
+  for(auto i: subset) {
+    condensed.push_back(instances[i]);
   }
+  instances = condensed;
+  index();
+}
 
-  sort(distances.begin(), distances.end());
+size_t KNN::size() const {
+  if(tree) {
+    return tree->size();
+  }
+  return quantized ? quantized->size() : instances.size();
+}
 
-  for(unsigned int i = 0; i < k; i++) {
-    votes.push_back(distances[i].second);
+std::vector<int> KNN::predict_batch(const std::vector<Features> &features, const unsigned int workers) const {
+  if(quantized || (graph && ef > 0)) {
+    return ML::predict_batch(features, workers);
   }
 
-  return most_frequent(votes);
+  // a single sample for the whole batch, kept apart from the samples of one object
+  StageTimer timer(Stage::predict_batch);
+  std::vector<FeatureVector> queries;
+  queries.reserve(features.size());
+  for(auto& f: features) {
+    queries.push_back(f.get_features());
+  }
+  const auto neighbours = tree->search_batch(queries, k, workers);
+
+  std::vector<int> rv(features.size());
+  std::vector<int> votes;
+  for(size_t i = 0; i < neighbours.size(); i++) {
+    votes.clear();
+    for(auto& n: neighbours[i]) {
+      votes.push_back(classes[n.index]);
+    }
+    rv[i] = most_frequent(votes, labels.size());
+  }
+  return rv;
 }
 
 void KNN::store(const std::string &path) const {
   json j;
   j["model"] = "knn";
+  j["pipeline"] = pipeline;
   j["k"] = k;
   j["d"] = d;
   json inst;
-  for(auto i: instances) {
-    json instance;
-    instance["label"] = i.first;
-    instance["circularity"] = i.second.get_circularity();
-    instance["roundness"] = i.second.get_roundness();
-    instance["aspect_ratio"] = i.second.get_aspect_ratio();
-    instance["solidity"] = i.second.get_solidity();
-    json histogram;
-    for(auto h: i.second.get_histogram()) {
-      histogram.push_back(h);
+  if(quantized) {
+    // the codes are stored on the order of the index, which reloads to the same order
+    j["quantization"] = {{"bits", 8}, {"scale", quantized->get_scale()}, {"offset", quantized->get_offset()},
+      {"rerank", rerank}};
+    for(size_t i = 0; i < quantized->size(); i++) {
+      json instance;
+      if(exact) {
+        // the full precision features, only kept to re-rank the candidates
+        instance = point_features(exact->point(i));
+      }
+      instance["label"] = labels[classes[i]];
+      // two hex digits per code, an array would take a line per code
+      std::ostringstream codes;
+      for(auto c: quantized->codes(i)) {
+        codes << std::hex << std::setw(2) << std::setfill('0') << static_cast<unsigned int>(c);
+      }
+      instance["codes"] = codes.str();
+      inst.push_back(instance);
+    }
+  } else {
+    for(auto i: all_instances()) {
+      json instance = i.second;
+      instance["label"] = i.first;
+      inst.push_back(instance);
     }
-    instance["histogram"] = histogram;
-    inst.push_back(instance);
   }
   j["instances"] = inst;
+  if(graph) {
+    // the graph file is named after the model and referenced relative to it
+    const std::string filename = fs::path(path).filename().u8string() + ".hnsw";
+    graph->store(path + ".hnsw");
+    j["graph"] = filename;
+  }
 
   std::ofstream o(path);
   o << std::setw(2) << j << std::endl;
 }
 
-KNN& KNN::load(const json& j) {
+std::unique_ptr<KNN> KNN::load(const json& j, const std::string &path) {
   std::vector<std::pair<std::string, Features>> instances;
+  QuantizedStore::Parameters scale, offset;
+  const bool quantized = j.contains("quantization");
+  if(quantized) {
+    scale = j["quantization"]["scale"];
+    offset = j["quantization"]["offset"];
+  }
 
   for(auto i: j["instances"]) {
-    std::array<double, 8> hist;
-    double circularity = i["circularity"];
-    double roundness = i["roundness"];
-    double aspect_ratio = i["aspect_ratio"]; 
-    double solidity = i["solidity"];
-    
-    for(size_t k = 0; k < i["histogram"].size(); k++) {
-      hist[k] = i["histogram"][k];
+    if(quantized && !i.contains("solidity")) {
+      // the features are the values represented by the codes
+      const std::string codes = i["codes"];
+      std::array<double, QuantizedStore::dimensions> v;
+      for(size_t f = 0; f < v.size(); f++) {
+        v[f] = offset[f] + std::stoul(codes.substr(2 * f, 2), nullptr, 16) * scale[f];
+      }
+      std::array<double, 8> hist;
+      std::copy(v.begin(), v.begin() + hist.size(), hist.begin());
+      instances.push_back(std::pair(i["label"], Features(hist, v[8], v[9], v[10], v[11])));
+    } else {
+      instances.push_back(std::pair(i["label"], features_from_json(i)));
     }
-    
-    auto features = Features(hist, circularity, roundness, aspect_ratio, solidity);
-    instances.push_back(std::pair(i["label"], features));
   }
 
-  static KNN knn = KNN(j["k"], j["d"], instances);
+  if(quantized) {
+    // the instances were stored on the order of the codes, which the features quantize to again
+    auto knn = std::make_unique<KNN>(j["k"].get<unsigned int>(), j["d"].get<unsigned int>());
+    knn->instances = instances;
+    knn->label();
+    const bool features = !instances.empty() && j["instances"][0].contains("solidity");
+    knn->rerank = features ? j["quantization"].value("rerank", 0u) : 0;
+    const auto points = index_points(knn->instances, knn->by_class);
+    knn->keep_codes(points, std::make_shared<const QuantizedStore>(points, knn->d, scale, offset), features);
+    return knn;
+  }
+
+  auto knn = std::make_unique<KNN>(j["k"].get<unsigned int>(), j["d"].get<unsigned int>(), instances);
+  if(j.contains("graph")) {
+    const fs::path graph_path = fs::path(path).parent_path() / j["graph"].get<std::string>();
+    try {
+      knn->graph = std::make_shared<const HNSW>(knn->tree, knn->d, graph_path.u8string());
+    } catch(const std::runtime_error &e) {
+      std::cerr<<e.what()<<", the graph is rebuilt"<<std::endl;
+      knn->build_graph(16);
+    }
+  }
   return knn;
 }
 
+void KNN::store_binary(const std::string &path) const {
+  std::ostringstream payload;
+  for(auto& l: labels) {
+    put<uint32_t>(payload, l.size());
+    payload.write(l.data(), l.size());
+  }
+  pad(payload);
+  // the class of each point of the index
+  payload.write(reinterpret_cast<const char*>(classes), size() * sizeof(uint32_t));
+  pad(payload);
+  // the sections that follow
+  put<uint32_t>(payload, quantized ? 1 : 0);
+  put<uint32_t>(payload, exact ? 1 : 0);
+  put<uint32_t>(payload, rerank);
+  put<uint32_t>(payload, graph ? 1 : 0);
+  pad(payload);
+  if(quantized) {
+    quantized->store(payload);
+    pad(payload);
+    if(exact) {
+      exact->store(payload);
+      pad(payload);
+    }
+  } else {
+    const auto points = tree ? tree : std::make_shared<const KDTree>(std::vector<FeatureVector>(), d);
+    points->store(payload);
+    pad(payload);
+  }
+  if(graph) {
+    graph->store(payload);
+  }
+
+  ModelHeader header{};
+  header.model = ModelType::knn;
+  header.pipeline = pipeline;
+  header.k = k;
+  header.d = d;
+  header.labels = labels.size();
+  header.feature_bytes = sizeof(feature_t);
+  header.instances = size();
+  write_model(path, header, payload.str());
+}
+
+std::unique_ptr<KNN> KNN::load_binary(const std::shared_ptr<const MappedFile> &file) {
+  const ModelHeader &header = file->header();
+  ModelReader reader(*file);
+  KNN model(header.k, header.d);
+  for(uint32_t i = 0; i < header.labels; i++) {
+    const uint32_t length = reader.get<uint32_t>();
+    model.labels.emplace_back(reader.view<char>(length), length);
+  }
+  reader.align();
+  // the classes, the index and its points stay on the mapping, already sorted by class
+  model.classes = reader.view<uint32_t>(header.instances);
+  model.owner = file;
+  for(uint64_t i = 0; i < header.instances; i++) {
+    if(model.classes[i] >= model.labels.size()) {
+      throw std::runtime_error("corrupted model file");
+    }
+  }
+  reader.align();
+  const bool quantized = reader.get<uint32_t>(), features = reader.get<uint32_t>();
+  const uint32_t rerank = reader.get<uint32_t>();
+  const bool graph = reader.get<uint32_t>();
+  reader.align();
+
+  if(quantized) {
+    model.quantized = std::make_shared<const QuantizedStore>(file, reader, header.instances, model.d);
+    reader.align();
+    if(features) {
+      model.exact = std::make_shared<const InstanceStore>(file, reader, header.instances, header.feature_bytes);
+      model.rerank = rerank;
+      reader.align();
+    }
+  } else {
+    model.tree = std::make_shared<const KDTree>(file, reader, model.d);
+    if(model.tree->size() != header.instances) {
+      throw std::runtime_error("corrupted model file");
+    }
+    reader.align();
+  }
+  if(graph) {
+    // the graph links the points of the tree, the quantized models have none
+    if(!model.tree) {
+      throw std::runtime_error("corrupted model file");
+    }
+    model.graph = std::make_shared<const HNSW>(file, reader, model.tree, model.d);
+  }
+
+  return std::make_unique<KNN>(std::move(model));
+}
+
 LR::LR() {
 }
 
@@ -277,7 +739,7 @@ std::ostream& operator<<(std::ostream &strm, const LR &o) {
 }
 
 std::vector<double> compute_gradient(const std::vector<double> &parameters,
-const std::vector<std::vector<double>> &features,
+const std::vector<FeatureVector> &features,
 const std::vector<double> &labels, const size_t m, const double beta) {
   std::vector<double> predictions, errors;
 
@@ -312,18 +774,18 @@ const std::vector<double> &labels, const size_t m, const double beta) {
 
 void LR::learn(const std::vector<std::pair<std::string, Features>> &inst) {
   std::vector<double> labels;
-  std::vector<std::vector<double>> features;
+  std::vector<FeatureVector> features;
+  features.reserve(inst.size());
   for(size_t i = 0; i < inst.size(); i++) {
     if (inst[i].first.compare("bad") == 0) {
       labels.push_back(0);
     } else {
       labels.push_back(1);
     }
-    auto feature = inst[i].second.get_features();
-    features.push_back(feature);
+    features.push_back(inst[i].second.get_features());
   }
 
-  size_t m = features[0].size();
+  size_t m = FeatureVector::length;
   std::vector<double> m_t, v_t, m_cap, v_cap;
   for(unsigned int i = 0; i < m; i++) {
     parameters.push_back(0);
@@ -356,8 +818,15 @@ void LR::learn(const std::vector<std::pair<std::string, Features>> &inst) {
   }
 }
 
-std::string LR::predict(const Object &object) const {
-  auto features = Features(object.get_contour()).get_features();
+const std::vector<std::string>& LR::get_labels() const {
+  // the class IDs used by learn
+  static const std::vector<std::string> labels = {"bad", "good"};
+  return labels;
+}
+
+int LR::predict(const Features &feature) const {
+  StageTimer timer(Stage::predict);
+  const auto& features = feature.get_features();
   double p = 0.0;
   for(unsigned int j = 0; j < parameters.size(); j++) {
     p += features[j] * parameters[j];
@@ -369,9 +838,9 @@ std::string LR::predict(const Object &object) const {
     pred = 0.0;
   }
   if(pred == 0.0) {
-    return "bad";
+    return 0;
   } else {
-    return "good";
+    return 1;
   }
 }
 
@@ -382,19 +851,43 @@ void LR::store(const std::string &path) const {
     jpar.push_back(p);
   }
   j["model"] = "lr";
+  j["pipeline"] = pipeline;
   j["parameters"] = jpar;
 
   std::ofstream o(path);
   o << std::setw(2) << j << std::endl;
 }
 
-LR& LR::load(const json& j) {
+std::unique_ptr<LR> LR::load(const json& j) {
   std::vector<double> parameters;
 
   for(auto p: j["parameters"]) {
     parameters.push_back(p);
   }
 
-  static LR lr = LR(parameters);
-  return lr;
+  return std::make_unique<LR>(parameters);
+}
+
+void LR::store_binary(const std::string &path) const {
+  std::ostringstream payload;
+  put<uint32_t>(payload, parameters.size());
+  for(auto p: parameters) {
+    put<double>(payload, p);
+  }
+
+  ModelHeader header{};
+  header.model = ModelType::lr;
+  header.pipeline = pipeline;
+  write_model(path, header, payload.str());
+}
+
+std::unique_ptr<LR> LR::load_binary(const MappedFile &file) {
+  ModelReader reader(file);
+  const uint32_t count = reader.get<uint32_t>();
+  std::vector<double> parameters;
+  for(uint32_t i = 0; i < count; i++) {
+    parameters.push_back(reader.get<double>());
+  }
+
+  return std::make_unique<LR>(parameters);
 }
\ No newline at end of file
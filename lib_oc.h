@@ -14,26 +14,66 @@
 #ifndef OC_H
 #define OC_H
 
+#include <memory>
+
 #include "json.hpp"
 #include "lib_od.h"
 
 using json = nlohmann::json;
 
+// precision of the stored features, double unless compiled with FEATURES_FLOAT32
+#ifdef FEATURES_FLOAT32
+typedef float feature_t;
+#else
+typedef double feature_t;
+#endif
+
+/**
+ * Version of the detection and feature extraction pipeline.
+ * It must be increased whenever get_objects or Features change their results, which discards every cached record
+ * and flags the models trained before the change.
+ */
+const unsigned int pipeline_version = 2;
+
+/**
+ * Fixed-size feature record: the bias term (1.0), the 8 bins of the chain code histogram,
+ * circularity, roundness, aspect ratio and solidity.
+ * It is padded with zeros to 16 values and aligned to a cache line, so loops over it can be vectorized
+ * and it is never allocated on the heap on its own.
+ */
+struct alignas(64) FeatureVector {
+  static constexpr size_t length = 13, padded = 16;
+  feature_t values[padded];
+
+  size_t size() const { return length; }
+  feature_t& operator[](const size_t i) { return values[i]; }
+  const feature_t& operator[](const size_t i) const { return values[i]; }
+  const feature_t* begin() const { return values; }
+  const feature_t* end() const { return values + length; }
+};
+
 /**
  * Features extraction class to obtain the following features: circularity, roundness, aspect ratio and solidity
  *
  */
 class Features {
   private:
-    std::array<double, 8> hist;
-    double circularity, roundness, aspect_ratio, solidity;
+    FeatureVector values;
     friend std::ostream& operator<<(std::ostream&, const Features&);
 
   public:
     Features(const std::array<double, 8> &, const double, const double, const double, const double);
-    Features(const std::vector<cv::Point>&);
+    Features(const ContourView&);
+
+    /**
+     * Computes the features of a contour whose geometry is already known (e.g. by its Object).
+     *
+     * @param contour the contour
+     * @param shape the geometry of the contour, see contour_shape
+     */
+    Features(const ContourView&, const ContourShape&);
     double distance(const Features&, const unsigned int p=2) const;
-    std::vector<double> get_features() const;
+    const FeatureVector& get_features() const;
     std::array<double, 8> get_histogram() const;
     double get_circularity() const;
     double get_roundness() const;
@@ -41,17 +81,114 @@ class Features {
     double get_solidity() const;
 };
 
+/**
+ * Serializes the features into a json object (circularity, roundness, aspect_ratio, solidity and histogram).
+ * Found by nlohmann::json through ADL, so a Features can be assigned directly to a json value.
+ *
+ * @param j destination json object
+ * @param f features to serialize
+ */
+void to_json(json&, const Features&);
+
+/**
+ * Reads the features from a json object written by to_json.
+ *
+ * @param j source json object
+ * @return the features
+ */
+Features features_from_json(const json&);
+
+/**
+ * Interface of the classification models.
+ * A model is owned by whoever loads it; once built, its const methods (the predictions) are safe to call
+ * from several threads at once.
+ */
 class ML {
   public:
+    virtual ~ML() = default;
     virtual void learn(const std::vector<std::pair<std::string, Features>>&) = 0;
-    virtual std::string predict(const Object&) const = 0;
     virtual void store(const std::string&) const = 0;
-    
-    static ML& load(const std::string&);
+
+    /**
+     * Writes the model on the binary format (see lib_mf.h), which ML::load maps in place.
+     *
+     * @param path the model file
+     */
+    virtual void store_binary(const std::string&) const = 0;
+
+    /**
+     * Classifies a feature vector.
+     *
+     * @param features features of the object
+     * @return the class ID, an index on get_labels()
+     */
+    virtual int predict(const Features&) const = 0;
+
+    /**
+     * @return the label of each class ID
+     */
+    virtual const std::vector<std::string>& get_labels() const = 0;
+
+    /**
+     * Classifies an object, using the features cached on the object.
+     *
+     * @param object the object to classify
+     * @return the label of the object
+     */
+    std::string predict(const Object&) const;
+
+    /**
+     * Classifies every row of a contiguous feature matrix (e.g. all the cells of a slide).
+     *
+     * @param features one feature vector per object
+     * @param workers number of threads used
+     * @return the class ID of each object
+     */
+    virtual std::vector<int> predict_batch(const std::vector<Features>&, const unsigned int workers=1) const;
+
+    /**
+     * Trades accuracy for speed on the following predictions, on the models that support it.
+     *
+     * @param ef the effort of the approximate search (0 restores the exact predictions)
+     * @return true if the model supports approximate predictions
+     */
+    virtual bool approximate(const unsigned int) { return false; }
+
+    /**
+     * Changes the number of candidates ranked again on the full precision features, on the quantized models.
+     *
+     * @param rerank the number of candidates per neighbour, 0 keeps the order of the codes
+     * @return true if the model kept the features needed to re-rank
+     */
+    virtual bool set_rerank(const unsigned int) { return false; }
+
+    /**
+     * Loads a model, json or binary (detected by the first bytes of the file).
+     * A model trained on another pipeline version (or before the version was stored) is loaded with a warning,
+     * its features no longer match the ones computed.
+     *
+     * @param path the model file
+     * @return the model, a new one on every call
+     */
+    static std::unique_ptr<ML> load(const std::string&);
 
     friend std::ostream& operator<<(std::ostream&, const ML&);
+
+  protected:
+    static std::unique_ptr<ML> stamp(std::unique_ptr<ML>, const std::string&, const unsigned int);
+
+    // pipeline version of the training features, kept when the model is stored again (e.g. by convert)
+    unsigned int pipeline = pipeline_version;
 };
 
+// defined on the Nearest Neighbours library (lib_nn)
+class KDTree;
+class HNSW;
+class QuantizedStore;
+class InstanceStore;
+// defined on the Model File library (lib_mf)
+class MappedFile;
+
 /**
  * A kNN implementation class
  *
@@ -60,17 +197,103 @@ class KNN : public ML {
   private:
     unsigned int k, d;
     std::vector<std::pair<std::string, Features>> instances;
+    // sorted labels and the class ID of each instance
+    std::vector<std::string> labels;
+    std::vector<int> ids;
+    // the class ID of each point of the indexes, owned by the model or the mapped file of a binary model
+    std::shared_ptr<const void> owner;
+    const uint32_t *classes;
+    // index over the instances (built by learn and load), its points are the instances sorted by class ID;
+    // the quantized models drop it (and the instances) and keep only the codes
+    std::shared_ptr<const KDTree> tree;
+    std::vector<unsigned int> by_class;
+    // optional graph over the same points for approximate searches, used when ef > 0
+    std::shared_ptr<const HNSW> graph;
+    unsigned int ef;
+    // optional 8 bit codes of the same points, which replace the tree and are stored instead of the features;
+    // the best rerank * k candidates are ranked again on the full precision points, kept only when rerank > 0
+    std::shared_ptr<const QuantizedStore> quantized;
+    std::shared_ptr<const InstanceStore> exact;
+    unsigned int rerank;
     friend std::ostream& operator<<(std::ostream&, const KNN&);
+    void label();
+    void index();
+    // the point i of the index, from the tree, the full precision points or the codes
+    FeatureVector point(const size_t) const;
+    // the instances of binary and quantized models are only on their points, they are read back before being changed
+    std::vector<std::pair<std::string, Features>> all_instances() const;
+    void materialize();
+    void keep_codes(const std::vector<FeatureVector>&, const std::shared_ptr<const QuantizedStore>&, const bool);
 
   public:
     KNN(const unsigned int, const unsigned int);
     KNN(const unsigned int, const unsigned int, const std::vector<std::pair<std::string, Features>>&);
     
     void learn(const std::vector<std::pair<std::string, Features>>&);
-    std::string predict(const Object&) const;
+    using ML::predict;
+    int predict(const Features&) const;
+
+    /**
+     * Classifies every object with a single exhaustive search of all of them (see KDTree::search_batch),
+     * or one object at a time on the approximate searches.
+     */
+    std::vector<int> predict_batch(const std::vector<Features>&, const unsigned int workers=1) const;
+    const std::vector<std::string>& get_labels() const;
+
+    /**
+     * Builds the graph used by the approximate searches, stored with the model.
+     *
+     * @param M the number of links per instance
+     */
+    void build_graph(const unsigned int);
+    bool approximate(const unsigned int);
+
+    /**
+     * Quantizes the instances to 8 bits per feature: the predictions scan the codes and the model is stored as codes.
+     * The tree, the graph and the instances are released; the full precision features are kept (and stored)
+     * only to re-rank the candidates. Learning new instances restores a tree over the kept features,
+     * or over the values of the codes.
+     *
+     * @param rerank the number of candidates (per neighbour) ranked again on the full precision features,
+     * 0 keeps the order of the codes and drops the features
+     */
+    void quantize(const unsigned int rerank=0);
+    bool set_rerank(const unsigned int);
+
+    /**
+     * Keeps only the instances near the boundaries of the classes.
+     * Wilson editing first removes the instances misclassified by their max(k, 3) nearest neighbours (noise),
+     * then Hart's condensed nearest neighbour keeps a subset that classifies every remaining instance
+     * correctly with its nearest neighbour.
+     */
+    void condense();
+    size_t size() const;
+
+    /**
+     * Writes the model as json, and the graph (if any) next to it as a binary file.
+     *
+     * @param path the model file
+     */
     void store(const std::string&) const;
     
-    static KNN& load(const json&);
+    /**
+     * @param j the model
+     * @param path the model file, the graph file is relative to it
+     */
+    static std::unique_ptr<KNN> load(const json&, const std::string&);
+
+    /**
+     * Writes the labels, the class of each instance and the index (the tree, or the codes and the features
+     * kept to re-rank them), which are used in place when loaded, followed by the graph if any.
+     *
+     * @param path the model file
+     */
+    void store_binary(const std::string&) const;
+
+    /**
+     * @param file the mapped model, shared by the tree
+     */
+    static std::unique_ptr<KNN> load_binary(const std::shared_ptr<const MappedFile>&);
 };
 
 /**
@@ -87,10 +310,14 @@ class LR : public ML {
     LR(const std::vector<double> parameters);
     
     void learn(const std::vector<std::pair<std::string, Features>>&);
-    std::string predict(const Object&) const;
+    using ML::predict;
+    int predict(const Features&) const;
+    const std::vector<std::string>& get_labels() const;
     void store(const std::string&) const;
+    void store_binary(const std::string&) const;
     
-    static LR& load(const json&);
+    static std::unique_ptr<LR> load(const json&);
+    static std::unique_ptr<LR> load_binary(const MappedFile&);
 };
 
 #endif
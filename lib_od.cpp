@@ -1,47 +1,86 @@
 #include "lib_od.h"
+#include "lib_pf.h"
+
+#include <climits>
+
+// chain code of a step, indexed by (sign(dy) + 1) * 3 + sign(dx) + 1 (a repeated point is coded as NW)
+const unsigned char chain_table[9] = {
+  7, 0, 1, // NW, N, NE
+  6, 7, 2, // W, -, E
+  5, 4, 3  // SW, S, SE
+};
+
+inline int chain_index(const cv::Point &a, const cv::Point &b) {
+  const int dx = b.x - a.x, dy = b.y - a.y;
+  return (((dy > 0) - (dy < 0)) + 1) * 3 + ((dx > 0) - (dx < 0)) + 1;
+}
 
 unsigned char encode(const cv::Point &a, const cv::Point &b) {
-  uchar up    = (a.y > b.y);
-  uchar left  = (a.x > b.x);
-  uchar down  = (a.y < b.y);
-  uchar right = (a.x < b.x);
-  uchar equx  = (a.y == b.y);
-  uchar equy  = (a.x == b.x);
-
-  return (up    && equy)  ? 0 : // N
-    (up    && right) ? 1 : // NE
-    (right && equx)  ? 2 : // E
-    (down  && right) ? 3 : // SE
-    (down  && equy)  ? 4 : // S
-    (left  && down)  ? 5 : // SW
-    (left  && equx)  ? 6 : // W
-    7 ; // NW
+  return chain_table[chain_index(a, b)];
 }
 
-void imfill(cv::Mat& src, cv::Mat& dst) {
-  cv::Point seed;
-  bool done = false;
-  // Search for the first black pixel in a BW image
-  for (auto i = 0; i < src.size().width && !done; i++) {
-    for(auto j = 0; j < src.size().height && !done; j++) {
-      if(src.at<uchar>(i,j) == 0) {
-        // The first black pixel will be select as the seed for the imfill
-        seed = cv::Point(i,j);
-        done = true;
-      }
+void imfill(cv::Mat& img, std::vector<int>& queue) {
+  CV_Assert(img.type() == CV_8UC1);
+  const int rows = img.rows, cols = img.cols;
+  // background pixels reached from the border are temporarily marked with this value
+  const uchar reached = 128;
+
+  queue.clear();
+  auto seed = [&](const int x, const int y) {
+    uchar& p = img.at<uchar>(y, x);
+    if(p == 0) {
+      p = reached;
+      queue.push_back(y * cols + x);
+    }
+  };
+  for(int x = 0; x < cols; x++) {
+    seed(x, 0);
+    seed(x, rows - 1);
+  }
+  for(int y = 1; y < rows - 1; y++) {
+    seed(0, y);
+    seed(cols - 1, y);
+  }
+
+  // 4-connected flood of the background (the same connectivity of cv::floodFill)
+  for(size_t head = 0; head < queue.size(); head++) {
+    const int p = queue[head], y = p / cols, x = p % cols;
+    if(x > 0) {
+      seed(x - 1, y);
+    }
+    if(x < cols - 1) {
+      seed(x + 1, y);
+    }
+    if(y > 0) {
+      seed(x, y - 1);
+    }
+    if(y < rows - 1) {
+      seed(x, y + 1);
+    }
+  }
+
+  // the background that was not reached is a hole, the reached background is restored
+  for(int y = 0; y < rows; y++) {
+    uchar* p = img.ptr<uchar>(y);
+    for(int x = 0; x < cols; x++) {
+      p[x] = (p[x] == 0) ? 255 : ((p[x] == reached) ? 0 : p[x]);
     }
   }
-  imfill(src, dst, seed);
 }
 
-void imfill(cv::Mat& src, cv::Mat& dst, cv::Point& seed) {
-  cv::Mat edges_neg = src.clone();
-  cv::floodFill(edges_neg, seed, CV_RGB(255,255,255));
-  bitwise_not(edges_neg, edges_neg);
-  dst = (edges_neg | src);
+void imfill(cv::Mat& img) {
+  std::vector<int> queue;
+  imfill(img, queue);
+}
+
+void imfill(cv::Mat& src, cv::Mat& dst) {
+  if(dst.data != src.data) {
+    src.copyTo(dst);
+  }
+  imfill(dst);
 }
 
-cv::Mat watershed(cv::Mat &src, cv::Mat &smooth){
+cv::Mat watershed(const cv::Mat &src, cv::Mat &smooth, const bool verbose){
   // Create a kernel that we will use to sharpen our image
   cv::Mat kernel = (cv::Mat_<float>(3,3) <<
   1,  1, 1,
@@ -57,7 +96,9 @@ cv::Mat watershed(cv::Mat &src, cv::Mat &smooth){
   
   // convert back to 8bits gray scale
   imgResult.convertTo(imgResult, CV_8UC3);
-  show_image(imgResult, "Stuff...");
+  if(verbose) {
+    show_image(imgResult, "Stuff...");
+  }
   
   // Perform the distance transform algorithm
   cv::Mat dist;
@@ -66,7 +107,9 @@ cv::Mat watershed(cv::Mat &src, cv::Mat &smooth){
   // Normalize the distance image for range = {0.0, 1.0}
   // so we can visualize and threshold it
   cv::normalize(dist, dist, 0, 1.0, cv::NORM_MINMAX);
-  show_image(dist, "Distance Transform Image");
+  if(verbose) {
+    show_image(dist, "Distance Transform Image");
+  }
   
   // Threshold to obtain the peaks
   // This will be the markers for the foreground objects
@@ -89,19 +132,20 @@ cv::Mat watershed(cv::Mat &src, cv::Mat &smooth){
   cv::Mat markers = cv::Mat::zeros(dist.size(), CV_32S);
 
   // Perform the watershed algorithm
-  std::cout<<"SRC = "<<imgResult.type()<<"("<<CV_8UC3<<"/"<<CV_32F<<")"<<" DST = "<<markers.type()<<std::endl;
   cv::watershed(imgResult, markers);
 
-  cv::Mat mark;
-  markers.convertTo(mark, CV_8U);
-  bitwise_not(mark, mark);
-  show_image(mark, "Markers");
+  if(verbose) {
+    cv::Mat mark;
+    markers.convertTo(mark, CV_8U);
+    bitwise_not(mark, mark);
+    show_image(mark, "Markers");
+  }
     //    imshow("Markers_v2", mark); // uncomment this if you want to see how the mark
 
   return markers;
 }
 
-void morphological_reconstruction(cv::Mat& mask, cv::Mat& marker, cv::Mat& kernel, cv::Mat& out) {
+void morphological_reconstruction_iterative(cv::Mat& mask, cv::Mat& marker, cv::Mat& kernel, cv::Mat& out) {
   cv::Mat img_rec = cv::Mat::zeros(cv::Size(marker.size().width, marker.size().height), CV_8UC1),
   img_dilate = cv::Mat::zeros(cv::Size(marker.size().width, marker.size().height), CV_8UC1);
   marker.copyTo(img_rec);
@@ -115,8 +159,164 @@ void morphological_reconstruction(cv::Mat& mask, cv::Mat& marker, cv::Mat& kerne
   } while(!eq);
 }
 
-std::vector<unsigned char> chain(const std::vector<cv::Point> &contour) {
+/**
+ * Checks if the image only contains the values 0 and 255.
+ */
+bool is_binary(const cv::Mat& img) {
+  for(int y = 0; y < img.rows; y++) {
+    const uchar* p = img.ptr<uchar>(y);
+    uchar other = 0;
+    for(int x = 0; x < img.cols; x++) {
+      other |= (p[x] != 0) & (p[x] != 255);
+    }
+    if(other) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void morphological_reconstruction(cv::Mat& mask, cv::Mat& marker, cv::Mat& kernel, cv::Mat& out,
+std::vector<int>& queue) {
+  CV_Assert(mask.type() == CV_8UC1 && marker.type() == CV_8UC1 && mask.size() == marker.size());
+  const int rows = mask.rows, cols = mask.cols;
+
+  // the neighbourhood is given by the non zero elements of the kernel (relative to its center)
+  // it is split into the neighbours visited before (N+) and after (N-) the pixel on a raster scan
+  std::vector<cv::Point> before, after;
+  for(int i = 0; i < kernel.rows; i++) {
+    for(int j = 0; j < kernel.cols; j++) {
+      const cv::Point o(j - kernel.cols/2, i - kernel.rows/2);
+      if(kernel.at<uchar>(i, j) == 0 || (o.x == 0 && o.y == 0)) {
+        continue;
+      }
+      if(o.y < 0 || (o.y == 0 && o.x < 0)) {
+        before.push_back(o);
+      } else {
+        after.push_back(o);
+      }
+    }
+  }
+
+  // the reconstruction starts from the marker bounded by the mask (out may alias the marker)
+  if(out.data != marker.data) {
+    marker.copyTo(out);
+  }
+  bool above = false;
+  for(int y = 0; y < rows && !above; y++) {
+    const uchar* m = mask.ptr<uchar>(y);
+    const uchar* o = out.ptr<uchar>(y);
+    for(int x = 0; x < cols; x++) {
+      above |= o[x] > m[x];
+    }
+  }
+  if(above) {
+    // the iterative reconstruction dilates the marker once before bounding it by the mask,
+    // which lets a marker above the mask reach further
+    cv::morphologyEx(out, out, cv::MORPH_DILATE, kernel, cv::Point(-1, -1), 1,
+      cv::BORDER_CONSTANT | cv::BORDER_ISOLATED, cv::morphologyDefaultBorderValue());
+  }
+  cv::min(out, mask, out);
+
+  auto inside = [rows, cols](const int x, const int y) {
+    return x >= 0 && y >= 0 && x < cols && y < rows;
+  };
+  queue.clear();
+  size_t head = 0;
+
+  if(is_binary(mask) && is_binary(out)) {
+    // binary fast path: keep the mask components (under the kernel connectivity) that touch the marker
+    for(int y = 0; y < rows; y++) {
+      const uchar* o = out.ptr<uchar>(y);
+      for(int x = 0; x < cols; x++) {
+        if(o[x]) {
+          queue.push_back(y * cols + x);
+        }
+      }
+    }
+    while(head < queue.size()) {
+      const int p = queue[head++], py = p / cols, px = p % cols;
+      for(auto n: {&before, &after}) {
+        for(auto& o: *n) {
+          const int x = px + o.x, y = py + o.y;
+          if(inside(x, y) && out.at<uchar>(y, x) == 0 && mask.at<uchar>(y, x) != 0) {
+            out.at<uchar>(y, x) = 255;
+            queue.push_back(y * cols + x);
+          }
+        }
+      }
+    }
+    return;
+  }
+
+  // hybrid algorithm (L. Vincent, 1993): one raster and one anti-raster scan,
+  // followed by a FIFO propagation of the pixels that can still grow
+  for(int y = 0; y < rows; y++) {
+    const uchar* m = mask.ptr<uchar>(y);
+    uchar* o = out.ptr<uchar>(y);
+    for(int x = 0; x < cols; x++) {
+      uchar v = o[x];
+      for(auto& n: before) {
+        if(inside(x + n.x, y + n.y)) {
+          v = std::max(v, out.at<uchar>(y + n.y, x + n.x));
+        }
+      }
+      o[x] = std::min(v, m[x]);
+    }
+  }
+
+  for(int y = rows - 1; y >= 0; y--) {
+    const uchar* m = mask.ptr<uchar>(y);
+    uchar* o = out.ptr<uchar>(y);
+    for(int x = cols - 1; x >= 0; x--) {
+      uchar v = o[x];
+      for(auto& n: after) {
+        if(inside(x + n.x, y + n.y)) {
+          v = std::max(v, out.at<uchar>(y + n.y, x + n.x));
+        }
+      }
+      o[x] = std::min(v, m[x]);
+      for(auto& n: after) {
+        const int nx = x + n.x, ny = y + n.y;
+        if(inside(nx, ny) && out.at<uchar>(ny, nx) < o[x] && out.at<uchar>(ny, nx) < mask.at<uchar>(ny, nx)) {
+          queue.push_back(y * cols + x);
+          break;
+        }
+      }
+    }
+  }
+
+  while(head < queue.size()) {
+    const int p = queue[head++], py = p / cols, px = p % cols;
+    const uchar v = out.at<uchar>(py, px);
+    for(auto n: {&before, &after}) {
+      for(auto& o: *n) {
+        const int x = px + o.x, y = py + o.y;
+        if(!inside(x, y)) {
+          continue;
+        }
+        uchar& q = out.at<uchar>(y, x);
+        const uchar m = mask.at<uchar>(y, x);
+        if(q < v && q != m) {
+          q = std::min(v, m);
+          queue.push_back(y * cols + x);
+        }
+      }
+    }
+  }
+}
+
+void morphological_reconstruction(cv::Mat& mask, cv::Mat& marker, cv::Mat& kernel, cv::Mat& out) {
+  std::vector<int> queue;
+  morphological_reconstruction(mask, marker, kernel, out, queue);
+}
+
+std::vector<unsigned char> chain(const ContourView &contour) {
   std::vector<unsigned char> rv;
+  if(contour.empty()) {
+    return rv;
+  }
+  rv.reserve(contour.size());
   size_t i = 0;
   for (; i<contour.size()-1; i++) {
     rv.push_back(encode(contour[i],contour[i+1]));
@@ -125,7 +325,163 @@ std::vector<unsigned char> chain(const std::vector<cv::Point> &contour) {
   return rv;
 }
 
-void show_images(const cv::Mat& im0, const cv::Mat& im1, const std::string &name) {
+ChainCode chain_code(const ContourView &contour) {
+  ChainCode rv;
+  rv.histogram.fill(0);
+  rv.length = contour.size();
+  rv.axial = rv.diagonal = 0;
+  if(contour.empty()) {
+    return rv;
+  }
+
+  // the codes are computed by blocks, the first loop has no branches nor stores to the histogram,
+  // and the second one spreads the increments over four histograms to break the store dependencies
+  const size_t block = 256, n = contour.size();
+  unsigned char codes[block];
+  std::array<std::array<size_t, 8>, 4> counts = {};
+  for(size_t start = 0; start < n; start += block) {
+    const size_t end = std::min(start + block, n), steps = end - start;
+    size_t axial = 0, diagonal = 0;
+    for(size_t i = start; i < end; i++) {
+      // the last point closes the contour
+      const cv::Point &a = contour[i], &b = contour[i + 1 < n ? i + 1 : 0];
+      const int sx = (b.x > a.x) - (b.x < a.x), sy = (b.y > a.y) - (b.y < a.y);
+      codes[i - start] = chain_table[(sy + 1) * 3 + sx + 1];
+      axial += (sx != 0) != (sy != 0);
+      diagonal += (sx != 0) && (sy != 0);
+    }
+    rv.axial += axial;
+    rv.diagonal += diagonal;
+    for(size_t j = 0; j < steps; j++) {
+      counts[j & 3][codes[j]]++;
+    }
+  }
+
+  for(size_t c = 0; c < rv.histogram.size(); c++) {
+    rv.histogram[c] = counts[0][c] + counts[1][c] + counts[2][c] + counts[3][c];
+  }
+  return rv;
+}
+
+ContourShape contour_shape(const ContourView &contour) {
+  ContourShape rv;
+  rv.area = rv.perimeter = rv.major_axis = rv.minor_axis = 0;
+  rv.bbox = cv::Rect();
+  if(contour.empty()) {
+    return rv;
+  }
+
+  // the moments are accumulated relative to the first point, which keeps the sums small on whole-slide coordinates
+  const size_t n = contour.size();
+  const cv::Point origin = contour[0];
+  double a00 = 0, a10 = 0, a01 = 0, a20 = 0, a11 = 0, a02 = 0, longer = 0;
+  size_t axial = 0, diagonal = 0;
+  int min_x = origin.x, max_x = origin.x, min_y = origin.y, max_y = origin.y;
+  for(size_t i = 0; i < n; i++) {
+    const cv::Point &a = contour[i], &b = contour[i + 1 < n ? i + 1 : 0];
+    min_x = std::min(min_x, a.x);
+    max_x = std::max(max_x, a.x);
+    min_y = std::min(min_y, a.y);
+    max_y = std::max(max_y, a.y);
+
+    const int dx = b.x - a.x, dy = b.y - a.y, d2 = dx * dx + dy * dy;
+    axial += d2 == 1;
+    diagonal += d2 == 2;
+    // steps longer than one pixel only appear on approximated contours
+    if(d2 > 2) {
+      longer += std::sqrt(static_cast<double>(d2));
+    }
+
+    const double xi = a.x - origin.x, yi = a.y - origin.y, xj = b.x - origin.x, yj = b.y - origin.y;
+    const double cross = xi * yj - xj * yi;
+    a00 += cross;
+    a10 += cross * (xi + xj);
+    a01 += cross * (yi + yj);
+    a20 += cross * (xi * xi + xi * xj + xj * xj);
+    a11 += cross * (xi * (2 * yi + yj) + xj * (yi + 2 * yj));
+    a02 += cross * (yi * yi + yi * yj + yj * yj);
+  }
+
+  rv.bbox = cv::Rect(min_x, min_y, max_x - min_x + 1, max_y - min_y + 1);
+  rv.perimeter = axial + diagonal * M_SQRT2 + longer;
+
+  // the sign of the moments depends on the orientation of the contour
+  const double m00 = a00 / 2.0;
+  rv.area = std::fabs(m00);
+  if(rv.area <= DBL_EPSILON) {
+    rv.area = 0;
+    return rv;
+  }
+  const double cx = a10 / (6.0 * m00), cy = a01 / (6.0 * m00),
+  mu20 = a20 / (12.0 * m00) - cx * cx,
+  mu11 = a11 / (24.0 * m00) - cx * cy,
+  mu02 = a02 / (12.0 * m00) - cy * cy;
+
+  // eigenvalues of the covariance matrix, the variance of a filled ellipse along an axis is (axis / 4)^2
+  const double mean = (mu20 + mu02) / 2.0,
+  delta = std::sqrt(std::max(0.0, (mu20 - mu02) * (mu20 - mu02) / 4.0 + mu11 * mu11));
+  rv.major_axis = 4.0 * std::sqrt(std::max(0.0, mean + delta));
+  rv.minor_axis = 4.0 * std::sqrt(std::max(0.0, mean - delta));
+  return rv;
+}
+
+// > 0 if o, a, b turn counter clockwise (on a y-up frame)
+inline long long cross(const cv::Point &o, const cv::Point &a, const cv::Point &b) {
+  return static_cast<long long>(a.x - o.x) * (b.y - o.y) - static_cast<long long>(a.y - o.y) * (b.x - o.x);
+}
+
+std::vector<cv::Point> convex_hull(const ContourView &contour) {
+  std::vector<cv::Point> rv;
+  if(contour.empty()) {
+    return rv;
+  }
+
+  // only the lowest and highest point of each column can be vertices of the hull,
+  // a closed 8-connected contour has at least one point per column, so this is linear on the number of points
+  int min_x = contour[0].x, max_x = contour[0].x;
+  for(const auto &p: contour) {
+    min_x = std::min(min_x, p.x);
+    max_x = std::max(max_x, p.x);
+  }
+  const size_t width = max_x - min_x + 1;
+  std::vector<int> low(width, INT_MAX), high(width, INT_MIN);
+  for(const auto &p: contour) {
+    const size_t c = p.x - min_x;
+    low[c] = std::min(low[c], p.y);
+    high[c] = std::max(high[c], p.y);
+  }
+
+  // the columns are already sorted, so the monotone chain needs no sort:
+  // the lower chain goes from the left to the right and the upper one comes back
+  auto add = [&rv](const cv::Point &p, const size_t start) {
+    // the points before start belong to the previous chain
+    while(rv.size() >= start + 2 && cross(rv[rv.size() - 2], rv.back(), p) <= 0) {
+      rv.pop_back();
+    }
+    rv.push_back(p);
+  };
+  for(size_t c = 0; c < width; c++) {
+    if(low[c] != INT_MAX) {
+      add(cv::Point(min_x + c, low[c]), 0);
+    }
+  }
+  const size_t lower = rv.size();
+  for(size_t c = width; c-- > 0;) {
+    if(high[c] != INT_MIN) {
+      const cv::Point p(min_x + c, high[c]);
+      if(rv.size() == lower && p == rv.back()) {
+        continue;
+      }
+      add(p, lower - 1);
+    }
+  }
+  if(rv.size() > 1 && rv.back() == rv.front()) {
+    rv.pop_back();
+  }
+  return rv;
+}
+
+cv::Mat concat_images(const cv::Mat& im0, const cv::Mat& im1) {
   size_t width = im0.size().width + im1.size().width,
   height = std::max(im0.size().height, im1.size().height);
   cv::Mat canvas = cv::Mat::zeros(cv::Size(width, height), CV_8UC3);
@@ -146,7 +502,11 @@ void show_images(const cv::Mat& im0, const cv::Mat& im1, const std::string &name
     im1.copyTo(canvas(cv::Rect(im0.size().width, 0, im1.size().width, im1.size().height)));
   }
 
-  show_image(canvas, name);
+  return canvas;
+}
+
+void show_images(const cv::Mat& im0, const cv::Mat& im1, const std::string &name) {
+  show_image(concat_images(im0, im1), name);
 }
 
 void show_image(const cv::Mat &image, const std::string &name) {
@@ -158,9 +518,37 @@ void show_image(const cv::Mat &image, const std::string &name) {
   cv::waitKey(0);
 }
 
-std::pair<std::vector<Object>,cv::Mat>
+PipelineWorkspace::PipelineWorkspace() {
+  kernel = cv::getStructuringElement(cv::MORPH_ELLIPSE, cv::Size(9, 9));
+  kernel_erode = cv::getStructuringElement(cv::MORPH_ELLIPSE, cv::Size(31, 31));
+  kernel_rec = cv::getStructuringElement(cv::MORPH_ELLIPSE, cv::Size(3, 3));
+}
+
+int PipelineWorkspace::reach() const {
+  // median filter, erosion, gradient and the 3x3 Sobel of Canny
+  return median_size / 2 + kernel_erode.rows / 2 + kernel.rows / 2 + 1;
+}
+
+cv::Mat PipelineWorkspace::buffer(cv::Mat& storage, const cv::Size& size, const int type) {
+  if(storage.type() != type || storage.cols < size.width || storage.rows < size.height) {
+    storage.create(std::max(storage.rows, size.height), std::max(storage.cols, size.width), type);
+  }
+  return storage(cv::Rect(0, 0, size.width, size.height));
+}
+
+Detection
 get_objects(const unsigned int pre, const std::string &path, const bool verbose) {
-  auto originalImage = cv::imread(path, cv::IMREAD_UNCHANGED);
+  PipelineWorkspace ws;
+  return get_objects(pre, path, ws, verbose);
+}
+
+Detection
+get_objects(const unsigned int pre, const std::string &path, PipelineWorkspace& ws, const bool verbose) {
+  cv::Mat originalImage;
+  {
+    StageTimer timer(Stage::read);
+    originalImage = cv::imread(path, cv::IMREAD_UNCHANGED);
+  }
 
   if(originalImage.empty()) {
     // NOT SUCCESSFUL : the data attribute is empty
@@ -168,61 +556,56 @@ get_objects(const unsigned int pre, const std::string &path, const bool verbose)
     exit(EXIT_FAILURE);
   }
 
-  // remove alpha channel
-  if(originalImage.channels() > 3) {
-    cv::cvtColor(originalImage, originalImage, cv::COLOR_RGBA2RGB);
-  }
+  return get_objects(pre, originalImage, ws, verbose);
+}
 
-  cv::Mat bw;
-  if(originalImage.channels() > 1) {
-    // Convert to a single-channel, intensity image
-    cv::cvtColor(originalImage, bw, cv::COLOR_BGR2GRAY, 1);
-  }
+/**
+ * Canny edge detector that only reads the pixels of the view (cv::Canny computes its Sobel derivatives
+ * with the pixels of the parent matrix around a region of interest, i.e. the rest of a workspace buffer).
+ * The result is the one of cv::Canny with a 3x3 aperture on a standalone image.
+ */
+void canny(const cv::Mat &image, cv::Mat &edges, PipelineWorkspace& ws, const double low, const double high) {
+  cv::Mat dx = ws.buffer(ws.dx, image.size(), CV_16SC1), dy = ws.buffer(ws.dy, image.size(), CV_16SC1);
+  cv::Sobel(image, dx, CV_16S, 1, 0, 3, 1, 0, cv::BORDER_REPLICATE | cv::BORDER_ISOLATED);
+  cv::Sobel(image, dy, CV_16S, 0, 1, 3, 1, 0, cv::BORDER_REPLICATE | cv::BORDER_ISOLATED);
+  cv::Canny(dx, dy, edges, low, high);
+}
 
-  if(verbose) {
-    show_image(bw, "Original image");
+/**
+ * Preprocessing chain of get_objects, from the gray scale image to the edges of the objects.
+ * A negative threshold selects the Otsu method, otherwise the given threshold is used.
+ */
+cv::Mat segment(const unsigned int pre, const cv::Mat &originalImage, const cv::Mat &bw,
+PipelineWorkspace& ws, const int threshold, const bool verbose) {
+  const cv::Size size = bw.size();
+  cv::Mat smooth_image = ws.buffer(ws.smooth, size, CV_8UC1);
+  {
+    StageTimer timer(Stage::median);
+    medianBlur(bw, smooth_image, ws.median_size);
   }
 
-  cv::Mat smooth_image;
-  medianBlur(bw, smooth_image, 9);
-
   if(verbose) {
     show_image(smooth_image, "Averaging Filter 9 x 9 - 1 Iter");
   }
 
-  // Binary image
-  cv::Mat binary_image;
-  unsigned int high_thresh = (unsigned int)cv::threshold(smooth_image, binary_image, 0, 255, cv::THRESH_OTSU),
-  low_thresh = 0;
-
-  cv::bitwise_not(binary_image, binary_image);
-  if(verbose) {
-    show_image(binary_image, "Threshold Image");
+  // Binary image (inverted, the cells are darker than the background)
+  cv::Mat binary_image = ws.buffer(ws.binary, size, CV_8UC1);
+  const int type = cv::THRESH_BINARY_INV | (threshold < 0 ? cv::THRESH_OTSU : 0);
+  unsigned int high_thresh = 0, low_thresh = 0;
+  {
+    StageTimer timer(Stage::threshold);
+    high_thresh = (unsigned int)cv::threshold(smooth_image, binary_image, std::max(threshold, 0), 255, type);
   }
 
-  //vários kernel para teste!
-  auto kernel = cv::getStructuringElement(cv::MORPH_ELLIPSE, cv::Size(9, 9));
-  auto kernel_erode = cv::getStructuringElement(cv::MORPH_ELLIPSE, cv::Size(31, 31));
-  auto kernel_close = cv::getStructuringElement(cv::MORPH_ELLIPSE, cv::Size(23, 23));
-  auto kernel_close_2 = cv::getStructuringElement(cv::MORPH_ELLIPSE, cv::Size(5, 5));
-  auto kernel_rec = cv::getStructuringElement(cv::MORPH_ELLIPSE, cv::Size(3, 3));
-  auto kernel_open = cv::getStructuringElement(cv::MORPH_ELLIPSE, cv::Size(45, 45));
-  //cv::morphologyEx(binary_image, smooth_image, cv::MORPH_OPEN, kernel);
-  //cv::morphologyEx(smooth_image, smooth_image, cv::MORPH_CLOSE, kernel);
-  
-  //RECONSTRUÇÃO MORFOLÓGICA
-  /*cv::morphologyEx(binary_image, binary_image, cv::MORPH_CLOSE, kernel_close);
   if(verbose) {
-    show_image(binary_image, "original");
+    show_image(binary_image, "Threshold Image");
   }
 
-  cv::morphologyEx(binary_image, binary_image, cv::MORPH_OPEN, kernel_open);
-  if(verbose) {
-    show_image(binary_image, "open");
-  }*/
-
   // fill some parts of original image
-  imfill(binary_image, binary_image); 
+  {
+    StageTimer timer(Stage::imfill);
+    imfill(binary_image, ws.queue);
+  }
   if(verbose){
     show_image(binary_image, "Fill Holes (imfill)");
   }
@@ -232,44 +615,41 @@ get_objects(const unsigned int pre, const std::string &path, const bool verbose)
     show_image(binary_image, "watershed");
   }*/
 
-  cv::morphologyEx(binary_image, smooth_image, cv::MORPH_ERODE, kernel_erode);
-  morphological_reconstruction(binary_image, smooth_image, kernel_rec, smooth_image);
+  // the smoothed image is no longer needed, its buffer holds the marker and then the reconstruction
+  {
+    StageTimer timer(Stage::erode);
+    cv::morphologyEx(binary_image, smooth_image, cv::MORPH_ERODE, ws.kernel_erode, cv::Point(-1, -1), 1,
+      cv::BORDER_CONSTANT | cv::BORDER_ISOLATED, cv::morphologyDefaultBorderValue());
+  }
+  {
+    StageTimer timer(Stage::reconstruction);
+    morphological_reconstruction(binary_image, smooth_image, ws.kernel_rec, smooth_image, ws.queue);
+  }
   if(verbose) {
     show_image(smooth_image, "Morphological Reconstruction");
   }
 
-  /*cv::morphologyEx(smooth_image, smooth_image, cv::MORPH_CLOSE, kernel_close_2);
-  if(verbose) {
-    show_image(smooth_image, "close");
-  }*/
-
-  // After binarization is necessary reduce noise, again
-  /*medianBlur(smooth_image, smooth_image, 9);
-
-  if(verbose) {
-    show_image(smooth_image, "Averaging Filter 9 x 9 - 2 Iter");
-  }*/
-
-  cv::Mat edges;
+  cv::Mat edges = ws.buffer(ws.edges, size, CV_8UC1);
+  StageTimer timer(Stage::edges);
   switch(pre){
     case 0:
       low_thresh = high_thresh / 2;
-      cv::Canny(smooth_image, edges, low_thresh, high_thresh);
+      canny(smooth_image, edges, ws, low_thresh, high_thresh);
       if(verbose) {
         //show_images(smooth_image, edges, "Canny");
         show_image(edges, "Canny");
       }
     break;
     case 1:
-      cv::morphologyEx(smooth_image, edges, cv::MORPH_GRADIENT, kernel);
+      cv::morphologyEx(smooth_image, edges, cv::MORPH_GRADIENT, ws.kernel, cv::Point(-1, -1), 1,
+        cv::BORDER_CONSTANT | cv::BORDER_ISOLATED, cv::morphologyDefaultBorderValue());
       if(verbose) {
         show_image(edges, "Morphological Gradient");
       }
     break;
     case 2:{
-      cv::Mat markers = watershed(originalImage, smooth_image);
+      cv::Mat markers = ::watershed(originalImage, smooth_image, verbose);
       double min, max;
-      std::cout<<"("<<min<<"; "<<max<<")"<<std::endl;
       cv::minMaxLoc(markers, &min, &max);
       std::vector<cv::Vec3b> colors;
       for (size_t i = 0; i < max; i++)
@@ -290,6 +670,8 @@ get_objects(const unsigned int pre, const std::string &path, const bool verbose)
             }
         }
       }
+      // the watershed markers are not converted into edges yet
+      edges.setTo(cv::Scalar(0));
       if(verbose) {
         show_image(edges, "Watershed");
       }
@@ -297,49 +679,199 @@ get_objects(const unsigned int pre, const std::string &path, const bool verbose)
     break;
     default:
       low_thresh = high_thresh / 2;
-      cv::Canny(smooth_image, edges, low_thresh, high_thresh);
+      canny(smooth_image, edges, ws, low_thresh, high_thresh);
       if(verbose) {
         show_image(edges, "Canny");
       }
     break;
   }
 
-  std::vector<std::vector<cv::Point>> contours;
-  cv::findContours(edges, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_NONE);
+  return edges;
+}
 
-  std::vector<Object> objects;
-  for (size_t i = 0; i < contours.size(); i++) {
-    objects.push_back(Object(contours[i]));
-    //std::cout << objects[objects.size()-1] << std::endl;
+Detection
+get_objects(const unsigned int pre, const cv::Mat &originalImage, PipelineWorkspace& ws, const bool verbose) {
+  const cv::Size size = originalImage.size();
+
+  cv::Mat bw;
+  {
+    StageTimer timer(Stage::gray);
+    if(originalImage.channels() > 3) {
+      // Convert to a single-channel, intensity image (ignoring the alpha channel)
+      bw = ws.buffer(ws.bw, size, CV_8UC1);
+      cv::cvtColor(originalImage, bw, cv::COLOR_BGRA2GRAY, 1);
+    } else if(originalImage.channels() > 1) {
+      // Convert to a single-channel, intensity image
+      bw = ws.buffer(ws.bw, size, CV_8UC1);
+      cv::cvtColor(originalImage, bw, cv::COLOR_BGR2GRAY, 1);
+    } else {
+      bw = originalImage;
+    }
   }
 
+  if(verbose) {
+    show_image(bw, "Original image");
+  }
+
+  cv::Mat edges = segment(pre, originalImage, bw, ws, -1, verbose);
+
+  Detection rv;
+  {
+    StageTimer timer(Stage::contours);
+    cv::findContours(edges, rv.contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_NONE);
+
+    rv.objects.reserve(rv.contours.size());
+    for (size_t i = 0; i < rv.contours.size(); i++) {
+      rv.objects.push_back(Object(rv.contours[i]));
+      //std::cout << rv.objects[rv.objects.size()-1] << std::endl;
+    }
+  }
+  rv.image = bw;
+
   if(verbose) {
     cv::destroyAllWindows();
   }
 
-  return std::pair(objects, bw);
+  return rv;
+}
+
+unsigned int otsu_threshold(const std::array<size_t, 256>& hist) {
+  // same criterion of cv::threshold with THRESH_OTSU, computed from a histogram
+  size_t total = 0;
+  double mu = 0;
+  for(size_t i = 0; i < hist.size(); i++) {
+    total += hist[i];
+    mu += i * (double)hist[i];
+  }
+  const double scale = 1.0 / total;
+  mu *= scale;
+
+  double mu1 = 0, q1 = 0, max_sigma = 0;
+  unsigned int max_val = 0;
+  for(size_t i = 0; i < hist.size(); i++) {
+    const double p_i = hist[i] * scale;
+    mu1 *= q1;
+    q1 += p_i;
+    const double q2 = 1.0 - q1;
+    if(std::min(q1, q2) < FLT_EPSILON || std::max(q1, q2) > 1.0 - FLT_EPSILON) {
+      continue;
+    }
+    mu1 = (mu1 + i * p_i) / q1;
+    const double mu2 = (mu - q1 * mu1) / q2, sigma = q1 * q2 * (mu1 - mu2) * (mu1 - mu2);
+    if(sigma > max_sigma) {
+      max_sigma = sigma;
+      max_val = i;
+    }
+  }
+  return max_val;
+}
+
+Detection
+get_objects_tiled(const unsigned int pre, const std::string &path, const int tile, PipelineWorkspace& ws, const int halo) {
+  if(pre == 2) {
+    std::cerr << "The watershed preprocessing does not support tiles..." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // the gray scale image (a byte per pixel) is the only buffer with the size of the image
+  cv::Mat bw;
+  {
+    StageTimer timer(Stage::read);
+    bw = cv::imread(path, cv::IMREAD_GRAYSCALE);
+  }
+
+  if(bw.empty()) {
+    // NOT SUCCESSFUL : the data attribute is empty
+    std::cerr << "Image "<<path<<" could not be open..." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  const cv::Rect image(0, 0, bw.cols, bw.rows);
+  auto expand = [&image](const cv::Rect& r, const int border) {
+    return cv::Rect(r.x - border, r.y - border, r.width + 2 * border, r.height + 2 * border) & image;
+  };
+  std::vector<cv::Rect> cores;
+  for(int y = 0; y < bw.rows; y += tile) {
+    for(int x = 0; x < bw.cols; x += tile) {
+      cores.push_back(cv::Rect(x, y, tile, tile) & image);
+    }
+  }
+
+  // first pass: the Otsu threshold of the whole smoothed image, so every tile is binarized alike
+  std::array<size_t, 256> hist;
+  hist.fill(0);
+  for(auto& core: cores) {
+    const cv::Rect outer = expand(core, ws.median_size / 2);
+    cv::Mat smooth = ws.buffer(ws.smooth, outer.size(), CV_8UC1);
+    StageTimer timer(Stage::median);
+    medianBlur(bw(outer), smooth, ws.median_size);
+    const cv::Mat inner = smooth(cv::Rect(core.x - outer.x, core.y - outer.y, core.width, core.height));
+    for(int y = 0; y < inner.rows; y++) {
+      const uchar* p = inner.ptr<uchar>(y);
+      for(int x = 0; x < inner.cols; x++) {
+        hist[p[x]]++;
+      }
+    }
+  }
+  const unsigned int threshold = otsu_threshold(hist);
+
+  // second pass: each tile is segmented with a halo that covers the reach of the kernels,
+  // and keeps the complete objects whose bounding box center lies on its core
+  const int border = std::max(halo, ws.reach());
+  Detection rv;
+  for(auto& core: cores) {
+    const cv::Rect outer = expand(core, border);
+    const cv::Mat region = bw(outer);
+
+    // a tile without pixels under the threshold has no foreground (the median filter cannot create them)
+    double min;
+    cv::minMaxLoc(region, &min);
+    if(min > threshold) {
+      continue;
+    }
+
+    cv::Mat edges = segment(pre, region, region, ws, threshold, false);
+    StageTimer timer(Stage::contours);
+    std::vector<std::vector<cv::Point>> contours;
+    cv::findContours(edges, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_NONE, outer.tl());
+
+    for (size_t i = 0; i < contours.size(); i++) {
+      const cv::Rect r = cv::boundingRect(contours[i]);
+      // objects cut by the halo (but not by the image border) are complete on a neighbour tile
+      const bool cut = (r.x <= outer.x && outer.x > 0) || (r.y <= outer.y && outer.y > 0) ||
+        (r.br().x >= outer.br().x && outer.br().x < image.width) ||
+        (r.br().y >= outer.br().y && outer.br().y < image.height);
+      if(!cut && core.contains(cv::Point(r.x + r.width / 2, r.y + r.height / 2))) {
+        // moving the points keeps their address, so the view stays valid
+        rv.contours.push_back(std::move(contours[i]));
+        rv.objects.push_back(Object(rv.contours.back()));
+      }
+    }
+  }
+
+  // the objects only refer to their contours, the image is released before they are classified
+  return rv;
 }
 
-Object::Object(std::vector<cv::Point> &_contour) {
+Object::Object(const ContourView &_contour) {
   contour = _contour;
-  boundRect = cv::boundingRect(_contour);
-  area = cv::contourArea(_contour);
+  shape = contour_shape(_contour);
 }
 
 std::ostream& operator<<(std::ostream &strm, const Object &o) {
-  strm << "BB: ["<<o.boundRect.width<<", "<<o.boundRect.height<<"] Area: "<<o.area;
+  strm << "BB: ["<<o.shape.bbox.width<<", "<<o.shape.bbox.height<<"] Area: "<<o.shape.area;
   return strm;
 }
 
 bool Object::operator<(const Object &other) const {
-  return area < other.area;
+  return shape.area < other.shape.area;
 }
 
-std::vector<cv::Point> Object::get_contour() const {
+ContourView Object::get_contour() const {
   return contour;
 }
 
 cv::Rect Object::get_boundRect() const {
-  return boundRect;
+  return shape.bbox;
 }
 
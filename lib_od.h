@@ -13,68 +13,329 @@
 #ifndef OD_H
 #define OD_H
 
+#include <array>
+#include <cfloat>
+#include <cmath>
 #include <iostream>
 #include <iomanip>
+#include <memory>
 
 #include "opencv2/core/core.hpp"
 #include "opencv2/imgproc/imgproc.hpp"
 #include "opencv2/highgui/highgui.hpp"
 #include "opencv2/core/types_c.h"
 
+/**
+ * Read-only view over the points of a contour, it does not own (nor copy) the points.
+ * The points are owned by a Detection (or by any std::vector that outlives the view).
+ */
+class ContourView {
+  private:
+    const cv::Point* points;
+    size_t length;
+
+  public:
+    ContourView() : points(nullptr), length(0) {}
+    ContourView(const cv::Point* p, const size_t n) : points(p), length(n) {}
+    ContourView(const std::vector<cv::Point>& c) : points(c.data()), length(c.size()) {}
+
+    const cv::Point* begin() const { return points; }
+    const cv::Point* end() const { return points + length; }
+    const cv::Point& operator[](const size_t i) const { return points[i]; }
+    size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+
+    /**
+     * @return a matrix header (CV_32SC2, one point per row) over the points, used to call OpenCV without copies
+     */
+    cv::Mat mat() const { return cv::Mat(static_cast<int>(length), 1, CV_32SC2, const_cast<cv::Point*>(points)); }
+};
+
+/**
+ * Geometry of a closed contour, see contour_shape.
+ */
+struct ContourShape {
+  // area enclosed by the contour (as cv::contourArea) and its length (as cv::arcLength)
+  double area, perimeter;
+  // full length of the axes of the ellipse with the same second order moments as the contour (0 when the area is 0)
+  double major_axis, minor_axis;
+  // bounding box of the points (as cv::boundingRect)
+  cv::Rect bbox;
+};
+
+class Features;
+
 class Object {
   private:
-    cv::Rect boundRect;
-    std::vector<cv::Point> contour;
-    double area;
+    ContourView contour;
+    // computed once, for the bounding box and the area and then for the features
+    ContourShape shape;
+    mutable std::shared_ptr<const Features> features;
     friend std::ostream& operator<<(std::ostream&, const Object&);
 
   public:
-    Object(std::vector<cv::Point>&);
+    Object(const ContourView&);
     bool operator<(const Object&) const;
-    std::vector<cv::Point> get_contour() const;
+    ContourView get_contour() const;
     cv::Rect get_boundRect() const;
+
+    /**
+     * Returns the features of the object, computed on the first call and cached afterwards (copies share the cache).
+     * Defined on the Object Classification library (lib_oc).
+     * The first call must not happen concurrently on the same object.
+     *
+     * @return the features of the contour of the object
+     */
+    const Features& get_features() const;
+};
+
+/**
+ * Result of get_objects: the contours found on the image, the objects (views over those contours) and the gray scale image
+ * (empty on get_objects_tiled).
+ * The contours are never copied after cv::findContours, so the result can only be moved (moving keeps the views valid).
+ */
+class Detection {
+  public:
+    std::vector<std::vector<cv::Point>> contours;
+    std::vector<Object> objects;
+    cv::Mat image;
+
+    Detection() = default;
+    Detection(Detection&&) = default;
+    Detection& operator=(Detection&&) = default;
+    Detection(const Detection&) = delete;
+    Detection& operator=(const Detection&) = delete;
 };
 
 void show_image(const cv::Mat&, const std::string&);
 
 void show_images(const cv::Mat&, const cv::Mat&, const std::string&);
 
-std::vector<unsigned char> chain(const std::vector<cv::Point>&);
+/**
+ * Places two images side by side in a single BGR canvas.
+ * Used by show_images and by the headless mode, which writes the canvas to disk instead of opening a window.
+ *
+ * @param im0 left image (gray or BGR)
+ * @param im1 right image (gray or BGR)
+ * @return the BGR canvas with both images
+ */
+cv::Mat concat_images(const cv::Mat&, const cv::Mat&);
+
+/**
+ * Freeman chain code of a closed contour (0 = N, 1 = NE, ..., 7 = NW), one code per step.
+ *
+ * @param contour the contour
+ * @return the code of each step, including the step that closes the contour
+ */
+std::vector<unsigned char> chain(const ContourView&);
 
-std::pair<std::vector<Object>, cv::Mat> get_objects(const unsigned int, const std::string&, const bool verbose=false);
+/**
+ * Summary of the chain code of a closed contour, without materializing the codes.
+ */
+struct ChainCode {
+  // number of steps with each code (0 = N, 1 = NE, ..., 7 = NW)
+  std::array<size_t, 8> histogram;
+  // number of steps (the length of the chain code)
+  size_t length;
+  // number of horizontal or vertical steps (even codes) and diagonal steps (odd codes)
+  size_t axial, diagonal;
+
+  /**
+   * Length of the contour, exact for 8-connected contours (cv::CHAIN_APPROX_NONE), as cv::arcLength.
+   *
+   * @return the perimeter of the contour
+   */
+  double perimeter() const {
+    return axial + diagonal * M_SQRT2;
+  }
+};
 
 /**
- * A simple implementation of the imfill image of Matlab.
- * According to the documentation, the function fills holes in the binary image src.
- * A hole is a set of background pixels that cannot be reached by filling in the background from the edge of the image.
+ * Computes the histogram of the chain code and the perimeter of a closed contour in a single pass.
+ * Each step is mapped to its code through a lookup table indexed by the signs of (dx, dy).
  *
- * @param src source image
- * @param dst destination image
- * @param seed seed point to the backgound (by default [0,0])
+ * @param contour the contour
+ * @return the histogram and the number of axial and diagonal steps
+ */
+ChainCode chain_code(const ContourView&);
+
+/**
+ * Computes the area, perimeter, moment based ellipse axes and bounding box of a closed contour in a single pass.
+ * The moments are integrated over the polygon (Green's theorem), so any number of points is valid:
+ * a contour without area (a point or a line) has area and axes 0.
+ *
+ * @param contour the contour
+ * @return the geometry of the contour
+ */
+ContourShape contour_shape(const ContourView&);
+
+/**
+ * Convex hull of a closed contour in linear time.
+ * The hull is built from the lowest and highest point of each column (monotone chain), so it does not
+ * require a simple polygon: the contours of cv::findContours go back over the parts that are one pixel wide.
+ *
+ * @param contour the contour
+ * @return the vertices of the hull, starting on the leftmost column and without collinear points
+ */
+std::vector<cv::Point> convex_hull(const ContourView&);
+
+/**
+ * Buffers and structuring elements reused by get_objects.
+ * Keeping one workspace per thread avoids allocating the intermediate images for every image.
+ * The buffers only grow, an image smaller than a previous one uses a region of the existing buffers.
+ * The filters that look around each pixel run with cv::BORDER_ISOLATED, so the pixels of the buffers
+ * outside that region (left by a larger image) never change the results.
+ */
+class PipelineWorkspace {
+  public:
+    PipelineWorkspace();
+
+    /**
+     * Returns a view with the requested size over the storage, growing the storage only when needed.
+     *
+     * @param storage backing buffer owned by the workspace
+     * @param size size of the view
+     * @param type type of the buffer
+     * @return a region of interest of the storage
+     */
+    static cv::Mat buffer(cv::Mat& storage, const cv::Size& size, const int type);
+
+    /**
+     * Distance (in pixels) that the preprocessing chain looks around each pixel.
+     * Used as the minimum halo between tiles.
+     *
+     * @return the sum of the radius of every filter and kernel of the chain
+     */
+    int reach() const;
+
+    // backing buffers of the pipeline stages
+    cv::Mat bw, smooth, binary, edges;
+    // derivatives of the Canny edge detector
+    cv::Mat dx, dy;
+    // scratch queue of imfill and of the morphological reconstruction
+    std::vector<int> queue;
+    // gradient (9x9), erosion (31x31) and reconstruction (3x3) kernels
+    cv::Mat kernel, kernel_erode, kernel_rec;
+    // aperture of the median filter
+    const int median_size = 9;
+};
+
+/**
+ * Detects the objects (cells) of an image.
+ *
+ * @param pre preprocessing method (0 - Canny; 1 - morphological gradient; 2 - watershed)
+ * @param path path of the image
+ * @param verbose shows the intermediate images
+ * @return the contours, the objects and the gray scale image
+ */
+Detection get_objects(const unsigned int, const std::string&, const bool verbose=false);
+
+/**
+ * Detects the objects (cells) of an image, reusing the buffers of the workspace.
+ * The returned gray scale image may be a view of the workspace, valid until it is used again.
+ *
+ * @param pre preprocessing method (0 - Canny; 1 - morphological gradient; 2 - watershed)
+ * @param path path of the image
+ * @param ws workspace of the calling thread
+ * @param verbose shows the intermediate images
+ * @return the contours, the objects and the gray scale image
+ */
+Detection get_objects(const unsigned int, const std::string&, PipelineWorkspace&, const bool verbose=false);
+
+/**
+ * Detects the objects (cells) of an image already decoded, reusing the buffers of the workspace.
+ *
+ * @param pre preprocessing method (0 - Canny; 1 - morphological gradient; 2 - watershed)
+ * @param image decoded image (gray, BGR or BGRA)
+ * @param ws workspace of the calling thread
+ * @param verbose shows the intermediate images
+ * @return the contours, the objects and the gray scale image
+ */
+Detection get_objects(const unsigned int, const cv::Mat&, PipelineWorkspace&, const bool verbose=false);
+
+/**
+ * Detects the objects (cells) of a large image (e.g. a whole slide) one tile at a time.
+ * The image is decoded whole, in gray scale (OpenCV cannot decode a region of a file), and every intermediate
+ * buffer only has the size of a tile plus its halo; the gray scale image is released before returning.
+ * A first pass computes a single Otsu threshold for the whole image, tiles without pixels under it are skipped.
+ * Each object is kept by the tile whose core holds the center of its bounding box, objects cut by a halo are dropped.
+ * For that reason the halo must be larger than half of the largest cell, it is never smaller than PipelineWorkspace::reach.
+ * The watershed preprocessing (2) is not supported.
+ *
+ * @param pre preprocessing method (0 - Canny; 1 - morphological gradient)
+ * @param path path of the image
+ * @param tile size of the (square) tiles
+ * @param ws workspace of the calling thread
+ * @param halo overlap between neighbour tiles
+ * @return the contours and objects of the whole image, without the image
  */
-void imfill(cv::Mat& src, cv::Mat& dst, cv::Point& seed);
+Detection get_objects_tiled(const unsigned int, const std::string&, const int, PipelineWorkspace&, const int halo=64);
 
 /**
  * A simple implementation of the imfill image of Matlab.
  * According to the documentation, the function fills holes in the binary image src.
  * A hole is a set of background pixels that cannot be reached by filling in the background from the edge of the image.
- * This function does not need a seed point, it will find the first black point on the background.
+ * Every background pixel on the border is used as a seed, and the image is filled in place with a single flood.
+ * Works on any region of interest, in which case the border of the region is the border used.
+ *
+ * @param img binary image (CV_8UC1, 0 is the background), filled in place
+ * @param queue scratch buffer for the flood, reused between calls
+ */
+void imfill(cv::Mat& img, std::vector<int>& queue);
+
+/**
+ * A simple implementation of the imfill image of Matlab, see the version above.
+ *
+ * @param img binary image (CV_8UC1, 0 is the background), filled in place
+ */
+void imfill(cv::Mat& img);
+
+/**
+ * A simple implementation of the imfill image of Matlab, see the version above.
+ * The source is only copied when the destination is a different image.
  *
  * @param src source image
  * @param dst destination image
- * @param seed seed point to the backgound (by default [0,0])
  */
 void imfill(cv::Mat& src, cv::Mat& dst);
 
+/**
+ * Morphological reconstruction by dilation of the marker under the mask.
+ * Uses the hybrid algorithm of L. Vincent (raster and anti-raster scans followed by a FIFO propagation),
+ * which visits each pixel a bounded number of times instead of dilating the whole image until stability.
+ * When both images are binary (0/255), it keeps the mask components that touch the marker with a single flood.
+ * The neighbourhood is given by the non zero elements of the kernel; out may be the same image as the marker.
+ * The result is the same as morphological_reconstruction_iterative, pixel by pixel, even where the marker
+ * is above the mask (the marker is then dilated once before being bounded by the mask, as the iterative version does).
+ *
+ * @param mask mask that bounds the reconstruction (CV_8UC1)
+ * @param marker seeds for the objects to keep (CV_8UC1, same size of the mask)
+ * @param kernel kernel that defines the neighbourhood of each pixel
+ * @param out output image
+ * @param queue scratch buffer for the FIFO, reused between calls
+ */
+void morphological_reconstruction(cv::Mat& mask, cv::Mat& marker, cv::Mat& kernel, cv::Mat& out, std::vector<int>& queue);
+
+/**
+ * Morphological reconstruction by dilation, see the version above.
+ *
+ * @param mask mask that bounds the reconstruction
+ * @param marker seeds for the objects to keep
+ * @param kernel kernel used in the morphological operations
+ * @param out output image
+ */
+void morphological_reconstruction(cv::Mat& mask, cv::Mat& marker, cv::Mat& kernel, cv::Mat& out);
+
 /**
  * A simple implementation of morphological reconstruction, based on this code:
  * https://stackoverflow.com/questions/29104091/morphological-reconstruction-in-opencv
+ * It repeats a full image dilation until nothing changes, it is kept as the reference to validate the faster version.
  *
- * @param in input image
- * @param mask mask that identifies the seeds for the objects to keep
+ * @param mask mask that bounds the reconstruction
+ * @param marker seeds for the objects to keep
  * @param kernel kernel used in the morphological operations
  * @param out output image
  */
-void morphological_reconstruction(cv::Mat& in, cv::Mat& mask, cv::Mat& kernel, cv::Mat& out);
+void morphological_reconstruction_iterative(cv::Mat& mask, cv::Mat& marker, cv::Mat& kernel, cv::Mat& out);
 
 #endif
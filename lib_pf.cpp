@@ -0,0 +1,122 @@
+#include "lib_pf.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using json = nlohmann::json;
+
+const std::array<const char*, static_cast<size_t>(Stage::count)> stage_names = {
+  "read", "gray", "median", "threshold", "imfill", "erode", "reconstruction", "edges", "contours", "features", "predict",
+  "predict_batch"
+};
+
+/**
+ * Samples recorded by a single thread.
+ */
+struct ThreadProfile {
+  std::array<std::vector<double>, static_cast<size_t>(Stage::count)> samples;
+  std::vector<std::pair<std::string, std::array<double, static_cast<size_t>(Stage::count)>>> images;
+  bool in_image = false;
+};
+
+std::atomic<bool> profiler::active(false);
+thread_local bool profiler::suspended = false;
+
+// the profiles outlive their threads, so the report can be built after the workers join
+std::mutex profiles_mutex;
+std::vector<std::unique_ptr<ThreadProfile>> profiles;
+
+ThreadProfile& thread_profile() {
+  thread_local ThreadProfile* profile = nullptr;
+  if(profile == nullptr) {
+    std::lock_guard<std::mutex> lock(profiles_mutex);
+    profiles.push_back(std::make_unique<ThreadProfile>());
+    profile = profiles.back().get();
+  }
+  return *profile;
+}
+
+void profiler::enable(const bool value) {
+  active.store(value);
+}
+
+void profiler::record(const Stage stage, const double seconds) {
+  auto& profile = thread_profile();
+  const size_t s = static_cast<size_t>(stage);
+  profile.samples[s].push_back(seconds);
+  if(profile.in_image) {
+    profile.images.back().second[s] += seconds;
+  }
+}
+
+void profiler::begin_image(const std::string &name) {
+  auto& profile = thread_profile();
+  std::array<double, static_cast<size_t>(Stage::count)> totals;
+  totals.fill(0);
+  profile.images.push_back(std::make_pair(name, totals));
+  profile.in_image = true;
+}
+
+void profiler::end_image() {
+  thread_profile().in_image = false;
+}
+
+double percentile(const std::vector<double> &sorted, const double p) {
+  // nearest rank
+  const size_t rank = static_cast<size_t>(std::ceil(p * sorted.size()));
+  return sorted[std::max<size_t>(rank, 1) - 1];
+}
+
+json profiler::report() {
+  std::lock_guard<std::mutex> lock(profiles_mutex);
+  json stages, images = json::array();
+
+  for(size_t s = 0; s < stage_names.size(); s++) {
+    std::vector<double> samples;
+    for(auto& profile: profiles) {
+      samples.insert(samples.end(), profile->samples[s].begin(), profile->samples[s].end());
+    }
+    if(samples.empty()) {
+      continue;
+    }
+    std::sort(samples.begin(), samples.end());
+    double total = 0;
+    for(auto v: samples) {
+      total += v;
+    }
+    json stage;
+    stage["count"] = samples.size();
+    stage["total_ms"] = total * 1e3;
+    stage["p50_ms"] = percentile(samples, 0.50) * 1e3;
+    stage["p95_ms"] = percentile(samples, 0.95) * 1e3;
+    stage["p99_ms"] = percentile(samples, 0.99) * 1e3;
+    stages[stage_names[s]] = stage;
+  }
+
+  std::vector<std::pair<std::string, std::array<double, static_cast<size_t>(Stage::count)>>> all;
+  for(auto& profile: profiles) {
+    all.insert(all.end(), profile->images.begin(), profile->images.end());
+  }
+  std::sort(all.begin(), all.end());
+  for(auto& image: all) {
+    json totals;
+    for(size_t s = 0; s < stage_names.size(); s++) {
+      if(image.second[s] > 0) {
+        totals[stage_names[s]] = image.second[s] * 1e3;
+      }
+    }
+    json entry;
+    entry["file"] = image.first;
+    entry["stages_ms"] = totals;
+    images.push_back(entry);
+  }
+
+  json j;
+  j["stages"] = stages;
+  j["images"] = images;
+  return j;
+}
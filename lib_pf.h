@@ -0,0 +1,142 @@
+/**
+ * @file lib_pf.h
+ * @brief Profiling library
+ *
+ * Low overhead timers for the stages of the detection and classification pipeline.
+ * The timers are disabled by default, in which case each one costs a single relaxed atomic load.
+ * When enabled, every thread records its samples on its own buffers, which are merged on the report.
+ *
+ * @author $Author: Catarina Silva $
+ * @version $Revision: 1.0 $
+ * @date $Date: 2020/10/14 $
+ */
+
+#ifndef PF_H
+#define PF_H
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+#include "json.hpp"
+
+/**
+ * Stages of the pipeline that can be timed.
+ * predict times the classification of one object, predict_batch the classification of all the objects of an image.
+ */
+enum class Stage {
+  read, gray, median, threshold, imfill, erode, reconstruction, edges, contours, features, predict, predict_batch,
+  count
+};
+
+namespace profiler {
+  extern std::atomic<bool> active;
+  extern thread_local bool suspended;
+
+  /**
+   * Enables (or disables) the timers, it should be called before any worker starts.
+   *
+   * @param value true to enable the timers
+   */
+  void enable(const bool value=true);
+
+  /**
+   * @return true if the timers are enabled, and not suspended on the calling thread
+   */
+  inline bool enabled() {
+    return active.load(std::memory_order_relaxed) && !suspended;
+  }
+
+  /**
+   * Adds a sample to the calling thread.
+   *
+   * @param stage the stage that was timed
+   * @param seconds duration of the stage
+   */
+  void record(const Stage, const double seconds);
+
+  /**
+   * Starts the aggregation of the samples of an image on the calling thread.
+   *
+   * @param name name of the image
+   */
+  void begin_image(const std::string&);
+
+  /**
+   * Closes the aggregation of the current image of the calling thread.
+   */
+  void end_image();
+
+  /**
+   * Merges the samples of every thread, it must not be called while the workers are running.
+   * Each stage reports the number of samples, the total and the 50, 95 and 99 percentiles (in milliseconds),
+   * and each image reports the total time spent on each stage.
+   *
+   * @return json document with the stages and images
+   */
+  nlohmann::json report();
+}
+
+/**
+ * Times the enclosing scope as a stage (does nothing when the profiler is disabled).
+ */
+class StageTimer {
+  private:
+    Stage stage;
+    bool running;
+    std::chrono::steady_clock::time_point start;
+
+  public:
+    StageTimer(const Stage s) : stage(s), running(profiler::enabled()) {
+      if(running) {
+        start = std::chrono::steady_clock::now();
+      }
+    }
+
+    ~StageTimer() {
+      if(running) {
+        profiler::record(stage, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+      }
+    }
+};
+
+/**
+ * Suspends the timers of the calling thread during the enclosing scope, e.g. on the workers of a stage timed
+ * as a whole by the thread that started them (their samples would belong to no image).
+ */
+class SuspendTimers {
+  private:
+    bool previous;
+
+  public:
+    SuspendTimers() : previous(profiler::suspended) {
+      profiler::suspended = true;
+    }
+
+    ~SuspendTimers() {
+      profiler::suspended = previous;
+    }
+};
+
+/**
+ * Aggregates the stages timed during the enclosing scope as one image.
+ */
+class ImageTimer {
+  private:
+    bool running;
+
+  public:
+    ImageTimer(const std::string& name) : running(profiler::enabled()) {
+      if(running) {
+        profiler::begin_image(name);
+      }
+    }
+
+    ~ImageTimer() {
+      if(running) {
+        profiler::end_image();
+      }
+    }
+};
+
+#endif
@@ -1,24 +1,119 @@
 #include <iostream>
+#include <fstream>
 
 #include "argh.h"
 #include "lib_od.h"
 #include "lib_oc.h"
 #include "lib_fs.h"
+#include "lib_mt.h"
+#include "lib_pf.h"
 
 void print_help() {
   std::cout<<"Program used to identify anomalous blood cells."<<std::endl
-    <<"usage: main [-p] [-k] [-i] [-o] [-h]"<<std::endl<<std::endl
+    <<"usage: main [-p] [-m] [-i] [-o] [-t] [-j] [-a] [-r] [-s] [-x] [-v] [-h]"<<std::endl<<std::endl
     <<"Parameters:"<<std::endl
     <<"  -p, the preprocessig method            [default = 0]"<<std::endl
-    <<"  -m, the classification model           [default = './resources/model/model.json']"<<std::endl
+    <<"  -m, the classification model, json or binary [default = './resources/model/model.json']"<<std::endl
     <<"  -i, the folder with images to classify [default = './resources/test/']"<<std::endl
+    <<"  -o, output folder for the overlays and results, '-' streams the results to stdout (implies -x)"<<std::endl
+    <<"  -t, tile size used to process large images (e.g. whole slides) by tiles, 0 disables [default = 0]"<<std::endl
+    <<"  -j, number of images classified concurrently, 0 uses all cores, at most one per core (above 1 implies -x) [default = 1]"<<std::endl
+    <<"  -a, approximate kNN search with a beam of the given size (HNSW), 0 is exact [default = 0]"<<std::endl
+    <<"  -r, candidates per neighbour ranked again on the features by quantized models, 0 keeps the codes [default = model]"<<std::endl
+    <<"  -s, writes the time spent on each stage of the pipeline to a json file"<<std::endl
+    <<"  -x, headless mode, never opens a window"<<std::endl
     <<"  -v, verbose"<<std::endl
     <<"  -h, this help message"<<std::endl;
 }
 
+/**
+ * Result of classifying a single image.
+ * Each worker writes only to the slots of the images it processed.
+ */
+struct ImageResult {
+  double good = 0, bad = 0;
+  std::string report;
+};
+
+ImageResult classify(const ML& model, PipelineWorkspace& ws, const unsigned int pre, const int tile,
+const fs::path& f, const std::string& output, const bool headless, const bool verbose, const unsigned int workers) {
+  const bool stream = output.compare("-") == 0;
+  ImageTimer timer(f.u8string());
+  auto detection = tile > 0 ? get_objects_tiled(pre, f, tile, ws) : get_objects(pre, f, ws, verbose && !headless);
+  const auto& objects = detection.objects;
+  const auto& originalImage = detection.image;
+
+  ImageResult rv;
+  // the drawing is only needed to show or write the overlay, which the tiles skip (it would take 4 bytes per pixel
+  // of the slide)
+  const bool draw = tile == 0 && (!headless || (!output.empty() && !stream));
+  cv::Mat drawing;
+  if (draw) {
+    drawing = cv::Mat::zeros(originalImage.size(), CV_8UC3);
+  }
+  // the features are computed once per object and classified as a single batch
+  std::vector<Features> features;
+  features.reserve(objects.size());
+  for(auto& object: objects) {
+    features.push_back(object.get_features());
+  }
+  const auto ids = model.predict_batch(features, workers);
+
+  json results = json::array();
+  for(size_t i = 0; i < objects.size(); i++) {
+    const auto& label = model.get_labels()[ids[i]];
+    //std::cout<<"Label = "<<label<<std::endl;
+    auto color = cv::Scalar(0,256,0);
+    if(label.compare("good") != 0) {
+      ++rv.bad;
+      color = cv::Scalar(0,0,256);
+    } else {
+      ++rv.good;
+    }
+    auto boundRect = objects[i].get_boundRect();
+    if (draw) {
+      cv::polylines(drawing, objects[i].get_contour().mat(), true, cv::Scalar(256, 256, 256));
+      cv::rectangle(drawing, boundRect.tl(), boundRect.br(), color, 2);
+    }
+
+    if (!output.empty()) {
+      json result;
+      result["bbox"] = {boundRect.x, boundRect.y, boundRect.width, boundRect.height};
+      result["label"] = label;
+      result["features"] = features[i];
+      results.push_back(result);
+    }
+  }
+
+  if (!output.empty()) {
+    json report;
+    report["file"] = f.u8string();
+    report["acanthocytes"] = rv.bad;
+    report["total"] = rv.bad + rv.good;
+    report["objects"] = results;
+    if (stream) {
+      rv.report = report.dump();
+    } else {
+      const std::string name = f.filename().u8string();
+      if (draw) {
+        cv::imwrite((fs::path(output) / (name + ".png")).u8string(), concat_images(originalImage, drawing));
+      }
+      std::ofstream o(fs::path(output) / (name + ".json"));
+      o << std::setw(2) << report << std::endl;
+    }
+  }
+
+  if (draw && !headless) {
+    show_images(originalImage, drawing, "Detection");
+    cv::destroyAllWindows();
+  }
+
+  return rv;
+}
+
 int main(const int argc, const char** argv) {
   argh::parser cmdl;
-  cmdl.add_params({ "-p", "-m", "-i" }); // batch pre-register multiple params: name + value
+  cmdl.add_params({ "-p", "-m", "-i", "-o", "-j", "-t", "-s", "-a", "-r" }); // batch pre-register multiple params: name + value
   cmdl.parse(argc, argv);
 
   if (cmdl["-h"]) {
@@ -26,11 +121,41 @@ int main(const int argc, const char** argv) {
     return EXIT_SUCCESS;
   }
 
+  unsigned int jobs = 1;
+  if (cmdl("-j")) {
+    std::string value;
+    cmdl("-j") >> value;
+    const int requested = std::atoi(value.c_str());
+    if (requested < 0) {
+      std::cerr<<"The number of jobs cannot be negative: "<<value<<std::endl;
+      print_help();
+      return EXIT_FAILURE;
+    }
+    jobs = worker_count(requested);
+  }
+
+  std::string output;
+  if (cmdl("-o")) {
+    cmdl("-o") >> output;
+  } else if (cmdl["-o"]) {
+    // argh takes a lone '-' for an option, which leaves '-o -' without a value
+    for (int i = 1; i + 1 < argc; i++) {
+      if (std::string(argv[i]) == "-o" && std::string(argv[i + 1]) == "-") {
+        output = "-";
+      }
+    }
+  }
+  // when the results are streamed, stdout only carries one json document per image
+  const bool stream = output.compare("-") == 0;
+  // windows can only be handled by the main thread
+  const bool headless = cmdl["-x"] || !output.empty() || jobs > 1;
+  std::ostream& log = stream ? std::cerr : std::cout;
+
   std::string input = "./resources/test/";
   if (cmdl("-i")) {
     cmdl("-i") >> input;
   }
-  std::cout<<"Input: "<<input<<std::endl;
+  log<<"Input: "<<input<<std::endl;
 
   unsigned int pre = 0;
   if (cmdl("-p")) {
@@ -38,46 +163,99 @@ int main(const int argc, const char** argv) {
     cmdl("-p") >> value;
     pre = std::atoi(value.c_str());
   }
-  std::cout<<"Preprocessig = "<<pre<<std::endl;
+  log<<"Preprocessig = "<<pre<<std::endl;
+
+  int tile = 0;
+  if (cmdl("-t")) {
+    std::string value;
+    cmdl("-t") >> value;
+    tile = std::atoi(value.c_str());
+  }
+  if (tile > 0) {
+    log<<"Tile = "<<tile<<std::endl;
+  }
+
+  std::string stats;
+  if (cmdl("-s")) {
+    cmdl("-s") >> stats;
+    profiler::enable();
+  }
 
   std::string model_path = "./resources/model/model.json";
   if (cmdl("-m")) {
     cmdl("-m") >> model_path;
   }
-  std::cout<<"Model: "<<model_path<<std::endl;
-  ML& model = ML::load(model_path);
+  log<<"Model: "<<model_path<<std::endl;
+  const std::unique_ptr<ML> model = ML::load(model_path);
+  if (cmdl("-a")) {
+    std::string value;
+    cmdl("-a") >> value;
+    const unsigned int ef = std::atoi(value.c_str());
+    if (model->approximate(ef)) {
+      log<<"Approximate search (ef) = "<<ef<<std::endl;
+    } else {
+      log<<"The model has no approximate search, -a is ignored"<<std::endl;
+    }
+  }
+  if (cmdl("-r")) {
+    std::string value;
+    cmdl("-r") >> value;
+    const unsigned int rerank = std::atoi(value.c_str());
+    if (model->set_rerank(rerank)) {
+      log<<"Rerank = "<<rerank<<std::endl;
+    } else {
+      log<<"The model kept no features to re-rank (train -q -r), -r is ignored"<<std::endl;
+    }
+  }
   //std::cout<<model<<std::endl;
 
+  if (!output.empty() && !stream) {
+    fs::create_directories(output);
+    log<<"Output: "<<output<<std::endl;
+  }
+
+  log<<"Jobs = "<<jobs<<std::endl;
+  if (jobs > 1) {
+    // the images are the unit of parallelism, avoid oversubscribing the cores
+    cv::setNumThreads(1);
+  }
+
+  const bool verbose = cmdl["-v"];
   auto files = get_files(input);
-  for (auto f: files) {
-    std::cout<<"File: "<<f<<std::endl;
-    auto pair = get_objects(pre, f, cmdl["-v"]);
-    auto objects = pair.first;
-    auto originalImage = pair.second;
-
-    cv::Mat drawing = cv::Mat::zeros(originalImage.size(), CV_8UC3);
-    double good = 0, bad = 0;
-    for(size_t i = 0; i < objects.size(); i++) {
-      auto label = model.predict(objects[i]);
-      //std::cout<<"Label = "<<label<<std::endl;
-      auto color = cv::Scalar(0,256,0);
-      if(label.compare("good")) {
-        ++good;
-        color = cv::Scalar(0,0,256);
-      } else {
-        ++bad;
-      }
-      auto boundRect = objects[i].get_boundRect();
-      std::vector<std::vector<cv::Point>> contours;
-      contours.push_back(objects[i].get_contour());
-      cv::drawContours(drawing, contours, 0, cv::Scalar(256, 256, 256));
-      cv::rectangle(drawing, boundRect.tl(), boundRect.br(), color, 2);
+  std::vector<ImageResult> results(files.size());
+  auto print = [&](const size_t i) {
+    log<<"File: "<<files[i]<<std::endl;
+    log<<"Acanthocytes = "<<results[i].bad<<"/"<<(results[i].bad+results[i].good)<<std::endl;
+    if (stream) {
+      std::cout<<results[i].report<<std::endl;
     }
+  };
 
-    std::cout<<"Acanthocytes = "<<bad<<"/"<<(bad+good)<<std::endl;
-    show_images(originalImage, drawing, "Detection");
-    cv::destroyAllWindows();
+  std::vector<PipelineWorkspace> workspaces(jobs);
+  // with a single image (e.g. a whole slide) the workers classify its cells instead
+  const unsigned int cells = files.size() == 1 ? jobs : 1;
+  parallel_for(files.size(), jobs, [&](const size_t i, const unsigned int w) {
+    results[i] = classify(*model, workspaces[w], pre, tile, files[i], output, headless, verbose, cells);
+    if (jobs == 1) {
+      print(i);
+    }
+  });
+
+  double good = 0, bad = 0;
+  for (size_t i = 0; i < results.size(); i++) {
+    if (jobs > 1) {
+      print(i);
+    }
+    good += results[i].good;
+    bad += results[i].bad;
   }
-  
+  log<<"Total acanthocytes = "<<bad<<"/"<<(bad+good)<<std::endl;
+
+  if (!stats.empty()) {
+    std::ofstream o(stats);
+    o << std::setw(2) << profiler::report() << std::endl;
+    log<<"Stage timings: "<<stats<<std::endl;
+  }
+
   return EXIT_SUCCESS;
 }
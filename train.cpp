@@ -1,14 +1,21 @@
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <optional>
+#include <sstream>
 #include <string>
 
 #include "argh.h"
 #include "lib_od.h"
 #include "lib_oc.h"
+#include "lib_fc.h"
 #include "lib_fs.h"
+#include "lib_mt.h"
+#include "lib_pf.h"
 
 void print_help() {
   std::cout<<"Program used to train a kNN model to identify anomalous blood cells."<<std::endl
-    <<"usage: train [-p] [-k] [-i] [-o] [-h]"<<std::endl<<std::endl
+    <<"usage: train [-p] [-m] [-k] [-d] [-i] [-o] [-j] [-s] [-g] [-e] [-q] [-r] [-c] [-v] [-h]"<<std::endl<<std::endl
     <<"Parameters:"<<std::endl
     <<"  -p, the preprocessig method               [default = 0]"<<std::endl
     <<"  -m, ML model (0 - ARFF; 1 - KNN; 2 - LR)  [default = 0]"<<std::endl
@@ -16,13 +23,20 @@ void print_help() {
     <<"  -d, Minkowski distance of order p         [default = 2]"<<std::endl
     <<"  -i, the input folder with images to train [default = './resources/train/']"<<std::endl
     <<"  -o, the output model                      [default = './resources/model/model.json']"<<std::endl
+    <<"  -j, number of images processed concurrently, 0 uses all cores, at most one per core [default = 1]"<<std::endl
+    <<"  -s, writes the time spent on each stage of the pipeline to a json file"<<std::endl
+    <<"  -g, builds a HNSW graph with the given links per instance, for approximate kNN search (main -a), not with -q"<<std::endl
+    <<"  -e, condenses the kNN instances (Wilson editing and Hart's condensed nearest neighbour)"<<std::endl
+    <<"  -q, stores the kNN instances quantized to 8 bits per feature, and searches them as such"<<std::endl
+    <<"  -r, with -q, keeps the features to rank again the best r * k candidates of the codes (main -r) [default = 0]"<<std::endl
+    <<"  -c, feature cache file, only new or changed images are processed"<<std::endl
     <<"  -v, verbose"<<std::endl
     <<"  -h, this help message"<<std::endl;
 }
 
 int main(const int argc, const char** argv) {
   argh::parser cmdl;
-  cmdl.add_params({"-p", "-m", "-d", "-k", "-i", "-o"}); // batch pre-register multiple params: name + value
+  cmdl.add_params({"-p", "-m", "-d", "-k", "-i", "-o", "-j", "-s", "-c", "-g", "-r"}); // batch pre-register multiple params: name + value
   cmdl.parse(argc, argv);
 
   if (cmdl["-h"]) {
@@ -30,6 +44,13 @@ int main(const int argc, const char** argv) {
     return EXIT_SUCCESS;
   }
 
+  // a quantized model releases its graph, which would never be stored
+  if (cmdl("-g") && cmdl["-q"]) {
+    std::cerr<<"-g cannot be combined with -q, the quantized models have no graph"<<std::endl;
+    print_help();
+    return EXIT_FAILURE;
+  }
+
   std::string input = "./resources/train/";
   if (cmdl("-i")) {
     cmdl("-i") >> input;
@@ -58,27 +79,105 @@ int main(const int argc, const char** argv) {
     d = std::atoi(value.c_str());
   }
 
+  unsigned int jobs = 1;
+  if (cmdl("-j")) {
+    std::string value;
+    cmdl("-j") >> value;
+    const int requested = std::atoi(value.c_str());
+    if (requested < 0) {
+      std::cerr<<"The number of jobs cannot be negative: "<<value<<std::endl;
+      print_help();
+      return EXIT_FAILURE;
+    }
+    jobs = worker_count(requested);
+  }
+  std::cout<<"Jobs = "<<jobs<<std::endl;
+
+  // list every (label, file) pair first, so the instances keep the same order for any number of workers
   auto classes = get_directories(input);
-  std::vector<std::pair<std::string, Features>> instances;
+  std::vector<std::pair<std::string, fs::path>> samples;
   for (auto c: classes) {
     const std::string label = c.filename().u8string();
     std::cout << "Loading the following class: " << label << std::endl;
-    auto files = get_files(c);
-    for (auto f: files) {
-      std::cout<<"File: "<<f<<std::endl;
-      auto objects = (get_objects(pre, f, cmdl["-v"])).first;
-      if (objects.size() > 0) {
-        auto object = *std::max_element(std::begin(objects), std::end(objects));
-        std::cout<<"Object = "<<object<<std::endl;
-        std::vector<cv::Point> contour = object.get_contour();
-        if(contour.size() > 0) {
-          auto features = Features(contour);
-          std::cout<<features<< std::endl;
-          std::pair<std::string, Features> p = std::make_pair(label, features);
-          instances.push_back(p);
-        }
+    for (auto f: get_files(c)) {
+      samples.push_back(std::make_pair(label, f));
+    }
+  }
+
+  if (jobs > 1) {
+    // the images are the unit of parallelism, avoid oversubscribing the cores
+    cv::setNumThreads(1);
+  }
+
+  std::string stats;
+  if (cmdl("-s")) {
+    cmdl("-s") >> stats;
+    profiler::enable();
+  }
+
+  std::unique_ptr<FeatureCache> cache;
+  if (cmdl("-c")) {
+    std::string value;
+    cmdl("-c") >> value;
+    cache = std::make_unique<FeatureCache>(value, pre);
+    std::cout<<"Cache: "<<value<<" ("<<cache->size()<<" records)"<<std::endl;
+  }
+
+  const bool verbose = cmdl["-v"] && jobs == 1;
+  std::vector<std::optional<Features>> extracted(samples.size());
+  std::vector<std::string> logs(samples.size());
+  // the hashes of the images that were processed, they are added to the cache after the workers join
+  std::vector<std::optional<uint64_t>> missed(samples.size());
+  std::vector<PipelineWorkspace> workspaces(jobs);
+  parallel_for(samples.size(), jobs, [&](const size_t i, const unsigned int w) {
+    ImageTimer timer(samples[i].second.u8string());
+    std::ostringstream log;
+    log<<"File: "<<samples[i].second<<std::endl;
+    if (cache) {
+      const uint64_t hash = hash_file(samples[i].second);
+      if (cache->find(hash, extracted[i])) {
+        logs[i] = log.str();
+        return;
+      }
+      missed[i] = hash;
+    }
+    auto detection = get_objects(pre, samples[i].second, workspaces[w], verbose);
+    const auto& objects = detection.objects;
+    if (objects.size() > 0) {
+      auto object = *std::max_element(std::begin(objects), std::end(objects));
+      log<<"Object = "<<object<<std::endl;
+      if(object.get_contour().size() > 0) {
+        extracted[i] = object.get_features();
+        log<<*extracted[i]<< std::endl;
       }
     }
+    logs[i] = log.str();
+  });
+
+  std::vector<std::pair<std::string, Features>> instances;
+  size_t processed = 0;
+  for (size_t i = 0; i < samples.size(); i++) {
+    std::cout<<logs[i];
+    if (extracted[i]) {
+      instances.push_back(std::make_pair(samples[i].first, *extracted[i]));
+    }
+    if (missed[i]) {
+      cache->insert(*missed[i], extracted[i]);
+      processed++;
+    }
+  }
+
+  if (cache) {
+    std::cout<<"Cached = "<<(samples.size() - processed)<<"/"<<samples.size()<<std::endl;
+    if (processed > 0) {
+      cache->store();
+    }
+  }
+
+  if (!stats.empty()) {
+    std::ofstream o(stats);
+    o << std::setw(2) << profiler::report() << std::endl;
+    std::cout<<"Stage timings: "<<stats<<std::endl;
   }
 
   unsigned int m = 0;
@@ -113,7 +212,7 @@ int main(const int argc, const char** argv) {
       <<"@ATTRIBUTE class        {good, bad}"<<std::endl
       <<"@DATA"<<std::endl;
       for(auto i: instances) {
-        auto fe = i.second.get_features();
+        const auto& fe = i.second.get_features();
         for (size_t j = 1; j < fe.size(); j++){
           std::cout<< fe[j] << ", ";
         }
@@ -124,6 +223,47 @@ int main(const int argc, const char** argv) {
       auto model = KNN(k, d);
       std::cout << "Model learning..." << std::endl;
       model.learn(instances);
+      if (cmdl["-e"]) {
+        // the effect on accuracy is estimated on a model without every 5th instance, which classifies them
+        std::vector<std::pair<std::string, Features>> fit, held_out;
+        for (size_t i = 0; i < instances.size(); i++) {
+          (i % 5 == 4 ? held_out : fit).push_back(instances[i]);
+        }
+        auto accuracy = [&held_out](const KNN& knn) {
+          size_t correct = 0;
+          for (auto& i: held_out) {
+            correct += knn.get_labels()[knn.predict(i.second)].compare(i.first) == 0;
+          }
+          return held_out.empty() ? 1.0 : static_cast<double>(correct) / held_out.size();
+        };
+        KNN split(k, d, fit);
+        const double before = accuracy(split);
+        split.condense();
+        const double after = accuracy(split);
+        std::cout<<"Held-out accuracy = "<<before<<" -> "<<after<<" ("<<std::showpos<<(after - before)
+          <<std::noshowpos<<")"<<std::endl;
+
+        const size_t total = model.size();
+        model.condense();
+        std::cout<<"Condensed = "<<model.size()<<"/"<<total<<" instances (reduction "
+          <<(total > 0 ? 100.0 * (total - model.size()) / total : 0.0)<<"%)"<<std::endl;
+      }
+      if (cmdl("-g")) {
+        std::string value;
+        cmdl("-g") >> value;
+        model.build_graph(std::atoi(value.c_str()));
+        std::cout<<"Graph: "<<output<<".hnsw"<<std::endl;
+      }
+      if (cmdl["-q"]) {
+        unsigned int rerank = 0;
+        if (cmdl("-r")) {
+          std::string value;
+          cmdl("-r") >> value;
+          rerank = std::atoi(value.c_str());
+        }
+        model.quantize(rerank);
+        std::cout<<"Quantized = 8 bits (rerank = "<<rerank<<")"<<std::endl;
+      }
       model.store(output);
       std::cout<<model<<std::endl;
       break;}